@@ -1,12 +1,55 @@
 #include <iostream>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
 #include "mk61commander.h"
+#include "mk61jobs.h"
 
-int main()
+int main(int argc, char* argv[])
 {
     try
     {
-        mk61_commander cmd;
-        cmd.run();
+        mk61_engine_kind_t engine_kind = mk61_engine_kind_t::microcode;
+        bool script = false;
+        bool check = false;
+        std::string script_name;
+        for (int i = 1; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--opcode") == 0)
+                engine_kind = mk61_engine_kind_t::opcode;
+            else if (strcmp(argv[i], "--check") == 0)
+                check = true;
+            else if (strcmp(argv[i], "--script") == 0)
+            {
+                // the script file follows, stdin without it
+                script = true;
+                if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+                    script_name = argv[++i];
+            }
+        }
+        if (check)
+        {
+            // both engines store every instruction of the index with its code
+            instruction_index instructions;
+            instructions.init();
+            instructions.check_codes();
+            std::cout << "Instruction codes match" << std::endl;
+            mk61_job_pool::check_initial_state();
+            std::cout << "Jobs start from their initial state" << std::endl;
+            return EXIT_SUCCESS;
+        }
+        mk61_commander cmd(engine_kind);
+        if (!script)
+            cmd.run();
+        else if (script_name.empty() || script_name == "-")
+            cmd.run_script(std::cin);
+        else
+        {
+            std::ifstream data(script_name);
+            if (!data)
+                throw std::logic_error("Cannot open " + script_name);
+            cmd.run_script(data);
+        }
         return EXIT_SUCCESS;
     }
     catch (std::exception& e)
@@ -0,0 +1,495 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstddef>
+#include "mk61batch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MK61_BATCH_AVX2
+#define MK61_AVX2_TARGET __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && defined(__AVX2__)
+#define MK61_BATCH_AVX2
+#define MK61_AVX2_TARGET
+#endif
+
+#ifdef MK61_BATCH_AVX2
+#include <immintrin.h>
+#endif
+
+static const int step_ticks = 560 * IK13_MTICK_COUNT; // ticks of one mk61_emu::do_step
+
+/**
+ * AVX2 kernel
+ */
+#ifdef MK61_BATCH_AVX2
+
+static_assert(offsetof(IK13_instruction_trace, MOD) == 2 * IK13_MTICK_COUNT, "Unexpected IK13_instruction_trace layout");
+static_assert(offsetof(IK13_instruction_trace, jump_hi) == offsetof(IK13_instruction_trace, key_scan) + 3,
+              "Unexpected IK13_instruction_trace layout");
+
+MK61_AVX2_TARGET static inline __m256i lanes_load(const int32_t *p)
+{
+    return _mm256_load_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+MK61_AVX2_TARGET static inline void lanes_store(int32_t *p, const __m256i value)
+{
+    _mm256_store_si256(reinterpret_cast<__m256i*>(p), value);
+}
+
+// mask ? a : b
+MK61_AVX2_TARGET static inline __m256i lanes_select(const __m256i mask, const __m256i a, const __m256i b)
+{
+    return _mm256_blendv_epi8(b, a, mask);
+}
+
+MK61_AVX2_TARGET static inline __m256i lanes_and(const __m256i value, const int32_t constant)
+{
+    return _mm256_and_si256(value, _mm256_set1_epi32(constant));
+}
+
+// all ones where the bit of the word is set
+MK61_AVX2_TARGET static inline __m256i lanes_bit(const __m256i word, const int bit)
+{
+    return _mm256_srai_epi32(_mm256_slli_epi32(word, 31 - bit), 31);
+}
+
+MK61_AVX2_TARGET static inline __m256i lanes_field(const __m256i word, const int bit, const int32_t mask)
+{
+    return lanes_and(_mm256_srli_epi32(word, bit), mask);
+}
+
+MK61_AVX2_TARGET static inline __m256i lanes_nonzero(const __m256i value)
+{
+    return _mm256_xor_si256(_mm256_cmpeq_epi32(value, _mm256_setzero_si256()), _mm256_set1_epi32(-1));
+}
+
+MK61_AVX2_TARGET static inline __m256i lanes_equal(const __m256i value, const int32_t constant)
+{
+    return _mm256_cmpeq_epi32(value, _mm256_set1_epi32(constant));
+}
+
+static inline mtick_t lanes_ring(const int slot)
+{
+    return static_cast<mtick_t>(slot < 0 ? slot + IK13_MTICK_COUNT : (slot >= IK13_MTICK_COUNT ? slot - IK13_MTICK_COUNT : slot));
+}
+
+/**
+ * Decoded instruction of every lane, changes only at the start of the IK13 cycle
+ */
+struct lanes_instruction
+{
+    __m256i trace;   // offset of IK13_instruction_trace
+    __m256i flags;   // key_scan, jump, jump_lo, jump_hi
+    __m256i MOD;
+};
+
+MK61_AVX2_TARGET static inline void load_instruction(lanes_instruction &instruction, const __m256i AK, const IK13_decoded_ROM *decoded)
+{
+    const char *traces = reinterpret_cast<const char*>(decoded->instructions);
+    instruction.trace = _mm256_mullo_epi32(AK, _mm256_set1_epi32(sizeof(IK13_instruction_trace)));
+    instruction.flags = _mm256_i32gather_epi32(reinterpret_cast<const int*>(traces + offsetof(IK13_instruction_trace, key_scan)),
+                                               instruction.trace, 1);
+    instruction.MOD = _mm256_srli_epi32(_mm256_i32gather_epi32(reinterpret_cast<const int*>(traces + offsetof(IK13_instruction_trace, MOD) - 3),
+                                                               instruction.trace, 1), 24);
+}
+
+/**
+ * IK13::tick for MK61_BATCH_WIDTH chips. Every row index depends on mtick only, the per-lane
+ * microprogram step and the raw microinstruction word are gathered from the ROM tables.
+ */
+MK61_AVX2_TARGET static inline void tick_IK13_avx2(mk61_lanes_IK13 &c, lanes_instruction &instruction,
+                                                   const IK13_ROM *rom, const IK13_decoded_ROM *decoded, const mtick_t mtick)
+{
+    const mtick_t signal_I = mtick >> 2;
+    const int signal_D = mtick / 12;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+
+    if (mtick == 0)
+    {
+        const __m256i AK = _mm256_add_epi32(lanes_load(c.R[36]), _mm256_slli_epi32(lanes_load(c.R[39]), 4));
+        lanes_store(c.AK, AK);
+        load_instruction(instruction, AK, decoded);
+    }
+    const __m256i key_scan = lanes_nonzero(lanes_and(instruction.flags, 0xff));
+    __m256i T = lanes_load(c.T);
+    if (mtick == 0)
+        T = _mm256_andnot_si256(key_scan, T);
+    else if (mtick == 144)
+    {
+        const __m256i jump = lanes_nonzero(lanes_field(instruction.flags, 8, 0xff));
+        lanes_store(c.R[37], lanes_select(jump, lanes_field(instruction.flags, 16, 0xff), lanes_load(c.R[37])));
+        lanes_store(c.R[40], lanes_select(jump, _mm256_srli_epi32(instruction.flags, 24), lanes_load(c.R[40])));
+    }
+    lanes_store(c.MOD, instruction.MOD);
+    __m256i L = lanes_load(c.L);
+    const __m256i L_zero = _mm256_cmpeq_epi32(L, zero);
+    const char *step = reinterpret_cast<const char*>(decoded->instructions[0].AMK[signal_I]);
+    const __m256i AMK = lanes_and(_mm256_i32gather_epi32(reinterpret_cast<const int*>(step),
+                                                         _mm256_add_epi32(instruction.trace, _mm256_andnot_si256(L_zero, one)), 1), 0xff);
+    lanes_store(c.AMK, AMK);
+    // raw microinstruction, see IK13_decoded_ROM for the meaning of the bits
+    const __m256i mi = _mm256_i32gather_epi32(reinterpret_cast<const int*>(rom->microinstructions), AMK, 4);
+
+    const __m256i key_x = lanes_load(c.key_x);
+    const __m256i key_y = lanes_load(c.key_y);
+    const __m256i key_column = _mm256_cmpeq_epi32(_mm256_set1_epi32(signal_D + 1), key_x);
+    const __m256i key_down = _mm256_cmpgt_epi32(key_y, zero);
+    const __m256i S1_mode = lanes_field(mi, 24, 3);
+    __m256i S = lanes_load(c.S);
+    __m256i S1 = lanes_load(c.S1);
+    S1 = _mm256_or_si256(S1, _mm256_and_si256(key_y,
+        _mm256_andnot_si256(key_column, _mm256_and_si256(key_down, _mm256_cmpgt_epi32(S1_mode, one)))));
+
+    const __m256i r = lanes_load(c.R[signal_I]);
+    __m256i m = lanes_load(c.M[signal_I]);
+    __m256i alpha = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(r, lanes_bit(mi, 0)), _mm256_and_si256(m, lanes_bit(mi, 1))),
+        _mm256_or_si256(_mm256_and_si256(lanes_load(c.ST[signal_I]), lanes_bit(mi, 2)), _mm256_andnot_si256(r, lanes_bit(mi, 3))));
+    alpha = _mm256_or_si256(lanes_and(_mm256_or_si256(alpha, _mm256_and_si256(S, lanes_bit(mi, 5))), 0xf),
+        _mm256_or_si256(lanes_and(_mm256_and_si256(L_zero, lanes_bit(mi, 4)), 0xa), lanes_and(lanes_bit(mi, 6), 4)));
+    __m256i beta = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(S1, lanes_bit(mi, 9)), _mm256_andnot_si256(S, lanes_bit(mi, 8))),
+        _mm256_and_si256(S, lanes_bit(mi, 7)));
+    beta = _mm256_or_si256(lanes_and(beta, 0xf),
+        _mm256_or_si256(lanes_and(lanes_bit(mi, 11), 1), lanes_and(lanes_bit(mi, 10), 6)));
+
+    // keyboard
+    T = lanes_select(key_scan, T, _mm256_andnot_si256(_mm256_cmpeq_epi32(key_y, zero), T));
+    const __m256i key_hit = _mm256_and_si256(key_scan, _mm256_and_si256(key_column, key_down));
+    S1 = lanes_select(key_hit, key_y, S1);
+    T = lanes_select(key_hit, one, T);
+    lanes_store(c.key_seen, lanes_select(key_hit, one, lanes_load(c.key_seen)));
+    if (signal_D < 12)
+    {
+        const __m256i comma = lanes_load(c.comma);
+        lanes_store(c.comma, lanes_select(_mm256_andnot_si256(L_zero, key_scan), _mm256_set1_epi32(signal_D), comma));
+    }
+
+    const __m256i gamma = _mm256_and_si256(one, _mm256_or_si256(
+        _mm256_or_si256(_mm256_andnot_si256(T, lanes_bit(mi, 14)), _mm256_andnot_si256(L, lanes_bit(mi, 13))),
+        _mm256_and_si256(L, lanes_bit(mi, 12))));
+    const __m256i sum = _mm256_add_epi32(_mm256_add_epi32(alpha, beta), gamma);
+    const __m256i sigma = lanes_and(sum, 0xf);
+    const __m256i P = _mm256_srli_epi32(sum, 4);
+
+    // R
+    const __m256i R_write = signal_I >= 36 ? _mm256_set1_epi32(-1) : _mm256_cmpeq_epi32(instruction.MOD, zero);
+    const __m256i R_mode = lanes_field(mi, 15, 7);
+    __m256i R = r;
+    R = lanes_select(lanes_equal(R_mode, 1), lanes_load(c.R[lanes_ring(signal_I + 3)]), R);
+    R = lanes_select(lanes_equal(R_mode, 2), sigma, R);
+    R = lanes_select(lanes_equal(R_mode, 3), S, R);
+    R = lanes_select(lanes_equal(R_mode, 4), _mm256_or_si256(r, _mm256_or_si256(S, sigma)), R);
+    R = lanes_select(lanes_equal(R_mode, 5), _mm256_or_si256(S, sigma), R);
+    R = lanes_select(lanes_equal(R_mode, 6), _mm256_or_si256(r, S), R);
+    R = lanes_select(lanes_equal(R_mode, 7), _mm256_or_si256(r, sigma), R);
+    lanes_store(c.R[signal_I], lanes_select(R_write, R, r));
+    int32_t *R_prev = c.R[lanes_ring(signal_I - 1)];
+    lanes_store(R_prev, lanes_select(_mm256_and_si256(R_write, lanes_bit(mi, 18)), sigma, lanes_load(R_prev)));
+    R_prev = c.R[lanes_ring(signal_I - 2)];
+    lanes_store(R_prev, lanes_select(_mm256_and_si256(R_write, lanes_bit(mi, 19)), sigma, lanes_load(R_prev)));
+
+    L = lanes_select(lanes_bit(mi, 21), _mm256_and_si256(P, one), L);
+    m = lanes_select(lanes_bit(mi, 20), S, m);
+
+    const __m256i S_mode = lanes_field(mi, 22, 3);
+    S = lanes_select(lanes_equal(S_mode, 1), S1, S);
+    S = lanes_select(lanes_equal(S_mode, 2), sigma, S);
+    S = lanes_select(lanes_equal(S_mode, 3), _mm256_or_si256(S1, sigma), S);
+    S1 = lanes_select(lanes_equal(S1_mode, 1), sigma, S1);
+    S1 = lanes_select(lanes_equal(S1_mode, 3), _mm256_or_si256(S1, sigma), S1);
+
+    const __m256i ST_mode = lanes_field(mi, 26, 3);
+    if (!_mm256_testz_si256(ST_mode, ST_mode))
+    {
+        int32_t *ST0 = c.ST[signal_I];
+        int32_t *ST1 = c.ST[lanes_ring(signal_I + 1)];
+        int32_t *ST2 = c.ST[lanes_ring(signal_I + 2)];
+        const __m256i x = lanes_load(ST0), y = lanes_load(ST1), z = lanes_load(ST2);
+        const __m256i mode1 = lanes_equal(ST_mode, 1);
+        const __m256i mode2 = lanes_equal(ST_mode, 2);
+        const __m256i mode3 = lanes_equal(ST_mode, 3);
+        __m256i value = lanes_select(mode1, sigma, x);
+        value = lanes_select(mode2, y, value);
+        lanes_store(ST0, lanes_select(mode3, _mm256_or_si256(sigma, y), value));
+        value = lanes_select(mode1, x, y);
+        value = lanes_select(mode2, z, value);
+        lanes_store(ST1, lanes_select(mode3, _mm256_or_si256(x, z), value));
+        value = lanes_select(mode1, y, z);
+        value = lanes_select(mode2, x, value);
+        lanes_store(ST2, lanes_select(mode3, _mm256_or_si256(y, x), value));
+    }
+
+    lanes_store(c.output, lanes_and(m, 0xf));
+    lanes_store(c.M[signal_I], lanes_load(c.input));
+    lanes_store(c.S, S);
+    lanes_store(c.S1, S1);
+    lanes_store(c.L, L);
+    lanes_store(c.T, T);
+    lanes_store(c.P, P);
+}
+
+MK61_AVX2_TARGET static inline void tick_IR2_avx2(mk61_lanes_IR2 &c, const mtick_t mtick)
+{
+    lanes_store(c.output, lanes_load(c.M[mtick]));
+    lanes_store(c.M[mtick], lanes_load(c.input));
+}
+
+/**
+ * mk61_chipset_state::tick<mode_61> for MK61_BATCH_WIDTH calculators
+ */
+MK61_AVX2_TARGET static void step_avx2(mk61_lanes_block &block, const IK13_ROM *const roms[3],
+                                       const IK13_decoded_ROM *const decoded[3], mtick_t IK13_mtick, mtick_t IR2_mtick)
+{
+    mk61_lanes_IK13 *const lanes[3] = { &block.IK1302, &block.IK1303, &block.IK1306 };
+    lanes_instruction instructions[3];
+    for (int i = 0; i < 3; i++)
+        load_instruction(instructions[i], lanes_load(lanes[i]->AK), decoded[i]);
+    for (int i = 0; i < step_ticks; i++)
+    {
+        memcpy(block.IK1302.input, block.IR2_2.output, sizeof(block.IK1302.input));
+        tick_IK13_avx2(block.IK1302, instructions[0], roms[0], decoded[0], IK13_mtick);
+        memcpy(block.IK1303.input, block.IK1302.output, sizeof(block.IK1303.input));
+        tick_IK13_avx2(block.IK1303, instructions[1], roms[1], decoded[1], IK13_mtick);
+        memcpy(block.IK1306.input, block.IK1303.output, sizeof(block.IK1306.input));
+        tick_IK13_avx2(block.IK1306, instructions[2], roms[2], decoded[2], IK13_mtick);
+        memcpy(block.IR2_1.input, block.IK1306.output, sizeof(block.IR2_1.input));
+        tick_IR2_avx2(block.IR2_1, IR2_mtick);
+        memcpy(block.IR2_2.input, block.IR2_1.output, sizeof(block.IR2_2.input));
+        tick_IR2_avx2(block.IR2_2, IR2_mtick);
+        memcpy(block.IK1302.M[IK13_mtick >> 2], block.IR2_2.output, sizeof(block.IR2_2.output));
+        IK13_mtick += 4;
+        if (IK13_mtick > 167)
+            IK13_mtick = 0;
+        IR2_mtick++;
+        if (IR2_mtick == IR2_MTICK_COUNT)
+            IR2_mtick = 0;
+    }
+}
+
+#endif // MK61_BATCH_AVX2
+
+/**
+ * Lanes conversion
+ */
+void mk61_batch_emu::load_chip(mk61_lanes_IK13 &c, uint8_t lane, const IK13 &chip)
+{
+    for (uint8_t i = 0; i < IK13_MTICK_COUNT; i++)
+    {
+        c.R[i][lane] = chip.R[i];
+        c.M[i][lane] = chip.M[i];
+        c.ST[i][lane] = chip.ST[i];
+    }
+    c.S[lane] = chip.S;
+    c.S1[lane] = chip.S1;
+    c.L[lane] = chip.L;
+    c.T[lane] = chip.T;
+    c.P[lane] = chip.P;
+    c.AMK[lane] = chip.AMK;
+    c.AK[lane] = chip.AK;
+    c.MOD[lane] = chip.MOD;
+    c.input[lane] = chip.input;
+    c.output[lane] = chip.output;
+    c.key_x[lane] = chip.key_x;
+    c.key_y[lane] = chip.key_y;
+    c.comma[lane] = chip.comma;
+    c.key_seen[lane] = chip.key_seen;
+}
+
+void mk61_batch_emu::store_chip(const mk61_lanes_IK13 &c, uint8_t lane, IK13 &chip)
+{
+    for (uint8_t i = 0; i < IK13_MTICK_COUNT; i++)
+    {
+        chip.R[i] = static_cast<io_t>(c.R[i][lane]);
+        chip.M[i] = static_cast<io_t>(c.M[i][lane]);
+        chip.ST[i] = static_cast<io_t>(c.ST[i][lane]);
+    }
+    chip.S = static_cast<io_t>(c.S[lane]);
+    chip.S1 = static_cast<io_t>(c.S1[lane]);
+    chip.L = static_cast<io_t>(c.L[lane]);
+    chip.T = static_cast<io_t>(c.T[lane]);
+    chip.P = static_cast<io_t>(c.P[lane]);
+    chip.AMK = static_cast<io_t>(c.AMK[lane]);
+    chip.AK = static_cast<io_t>(c.AK[lane]);
+    chip.MOD = static_cast<io_t>(c.MOD[lane]);
+    chip.input = static_cast<io_t>(c.input[lane]);
+    chip.output = static_cast<io_t>(c.output[lane]);
+    chip.key_x = static_cast<int8_t>(c.key_x[lane]);
+    chip.key_y = static_cast<int8_t>(c.key_y[lane]);
+    chip.comma = static_cast<int8_t>(c.comma[lane]);
+    chip.key_seen = static_cast<int8_t>(c.key_seen[lane]);
+}
+
+void mk61_batch_emu::load_chip(mk61_lanes_IR2 &c, uint8_t lane, const IR2 &chip)
+{
+    for (uint8_t i = 0; i < IR2_MTICK_COUNT; i++)
+        c.M[i][lane] = chip.M[i];
+    c.input[lane] = chip.input;
+    c.output[lane] = chip.output;
+}
+
+void mk61_batch_emu::store_chip(const mk61_lanes_IR2 &c, uint8_t lane, IR2 &chip)
+{
+    for (uint8_t i = 0; i < IR2_MTICK_COUNT; i++)
+        chip.M[i] = static_cast<io_t>(c.M[i][lane]);
+    chip.input = static_cast<io_t>(c.input[lane]);
+    chip.output = static_cast<io_t>(c.output[lane]);
+}
+
+/**
+ * mk61_batch_emu
+ */
+mk61_batch_emu::mk61_batch_emu(size_t count)
+    : m_count(count),
+      m_blocks((count + MK61_BATCH_WIDTH - 1) / MK61_BATCH_WIDTH),
+      m_angle_units(m_blocks.size() * MK61_BATCH_WIDTH)
+{
+    mk61_emu emu;
+    emu.set_power_state(engine_power_state_t::engine_on);
+    emu.get_chipset_state(m_power_on_state);
+    reset();
+}
+
+void mk61_batch_emu::reset()
+{
+    m_IK13_mtick = m_power_on_state.IK1302.mtick;
+    m_IR2_mtick = m_power_on_state.IR2_1.mtick;
+    for (mk61_lanes_block& block : m_blocks)
+        for (uint8_t lane = 0; lane < MK61_BATCH_WIDTH; lane++)
+            load_lane(block, lane, m_power_on_state);
+    for (angle_unit_t& angle_unit : m_angle_units)
+        angle_unit = angle_unit_t::radian;
+}
+
+bool mk61_batch_emu::is_vectorized()
+{
+#if defined(MK61_BATCH_AVX2) && defined(__GNUC__)
+    return __builtin_cpu_supports("avx2");
+#elif defined(MK61_BATCH_AVX2)
+    return true;
+#else
+    return false;
+#endif
+}
+
+void mk61_batch_emu::check_lane(size_t lane) const
+{
+    if (lane >= m_count)
+        throw std::logic_error("Calculator index is out of range");
+}
+
+void mk61_batch_emu::load_lane(mk61_lanes_block& block, uint8_t lane, const mk61_chipset_state& state)
+{
+    load_chip(block.IR2_1, lane, state.IR2_1);
+    load_chip(block.IR2_2, lane, state.IR2_2);
+    load_chip(block.IK1302, lane, state.IK1302);
+    load_chip(block.IK1303, lane, state.IK1303);
+    load_chip(block.IK1306, lane, state.IK1306);
+}
+
+void mk61_batch_emu::store_lane(const mk61_lanes_block& block, uint8_t lane, mk61_chipset_state& state) const
+{
+    memcpy(&state, &m_power_on_state, sizeof(state));
+    store_chip(block.IR2_1, lane, state.IR2_1);
+    store_chip(block.IR2_2, lane, state.IR2_2);
+    store_chip(block.IK1302, lane, state.IK1302);
+    store_chip(block.IK1303, lane, state.IK1303);
+    store_chip(block.IK1306, lane, state.IK1306);
+    state.IR2_1.mtick = m_IR2_mtick;
+    state.IR2_2.mtick = m_IR2_mtick;
+    state.IK1302.mtick = m_IK13_mtick;
+    state.IK1303.mtick = m_IK13_mtick;
+    state.IK1306.mtick = m_IK13_mtick;
+}
+
+void mk61_batch_emu::step_scalar(mk61_lanes_block& block, uint8_t lanes)
+{
+    mk61_chipset_state state;
+    for (uint8_t lane = 0; lane < lanes; lane++)
+    {
+        store_lane(block, lane, state);
+        for (int i = 0; i < step_ticks; i++)
+            state.tick<mk61emu_mode_t::mode_61>();
+        load_lane(block, lane, state);
+    }
+}
+
+void mk61_batch_emu::do_step()
+{
+#ifdef MK61_BATCH_AVX2
+    const bool vectorized = is_vectorized();
+    const IK13_ROM *const roms[3] = {
+        m_power_on_state.IK1302.ROM,
+        m_power_on_state.IK1303.ROM,
+        m_power_on_state.IK1306.ROM
+    };
+    const IK13_decoded_ROM *const decoded[3] = {
+        m_power_on_state.IK1302.decoded,
+        m_power_on_state.IK1303.decoded,
+        m_power_on_state.IK1306.decoded
+    };
+#endif
+    for (size_t i = 0; i < m_blocks.size(); i++)
+    {
+        mk61_lanes_block& block = m_blocks[i];
+        for (uint8_t lane = 0; lane < MK61_BATCH_WIDTH; lane++)
+        {
+            block.IK1303.key_y[lane] = 1;
+            block.IK1303.key_x[lane] = static_cast<int8_t>(m_angle_units[i * MK61_BATCH_WIDTH + lane]);
+        }
+#ifdef MK61_BATCH_AVX2
+        if (vectorized)
+            step_avx2(block, roms, decoded, m_IK13_mtick, m_IR2_mtick);
+        else
+#endif
+            step_scalar(block, static_cast<uint8_t>(std::min<size_t>(MK61_BATCH_WIDTH, m_count - i * MK61_BATCH_WIDTH)));
+        memset(block.IK1302.key_x, 0, sizeof(block.IK1302.key_x));
+        memset(block.IK1302.key_y, 0, sizeof(block.IK1302.key_y));
+    }
+    // a step is a whole number of IK13 cycles, but not of IR2 revolutions
+    static_assert(step_ticks % IK13_MTICK_COUNT == 0, "The step must not change the phase of IK13");
+    m_IR2_mtick = static_cast<mtick_t>((m_IR2_mtick + step_ticks) % IR2_MTICK_COUNT);
+}
+
+void mk61_batch_emu::set_key(size_t lane, const uint8_t key1, const uint8_t key2)
+{
+    check_lane(lane);
+    mk61_lanes_IK13& chip = m_blocks[lane / MK61_BATCH_WIDTH].IK1302;
+    chip.key_x[lane % MK61_BATCH_WIDTH] = static_cast<int8_t>(key1);
+    chip.key_y[lane % MK61_BATCH_WIDTH] = static_cast<int8_t>(key2);
+    chip.key_seen[lane % MK61_BATCH_WIDTH] = 0;
+}
+
+angle_unit_t mk61_batch_emu::get_angle_unit(size_t lane) const
+{
+    check_lane(lane);
+    return m_angle_units[lane];
+}
+
+void mk61_batch_emu::set_angle_unit(size_t lane, const angle_unit_t value)
+{
+    check_lane(lane);
+    m_angle_units[lane] = value;
+}
+
+bool mk61_batch_emu::is_running(size_t lane) const
+{
+    check_lane(lane);
+    return m_blocks[lane / MK61_BATCH_WIDTH].IK1302.comma[lane % MK61_BATCH_WIDTH] == 11;
+}
+
+void mk61_batch_emu::get_chipset_state(size_t lane, mk61_chipset_state& state) const
+{
+    check_lane(lane);
+    store_lane(m_blocks[lane / MK61_BATCH_WIDTH], lane % MK61_BATCH_WIDTH, state);
+}
+
+void mk61_batch_emu::set_chipset_state(size_t lane, const mk61_chipset_state& state)
+{
+    check_lane(lane);
+    if (state.IK1302.mtick != m_IK13_mtick || state.IK1303.mtick != m_IK13_mtick || state.IK1306.mtick != m_IK13_mtick ||
+        state.IR2_1.mtick != m_IR2_mtick || state.IR2_2.mtick != m_IR2_mtick)
+        throw std::logic_error("Chipset state is out of phase with the batch");
+    load_lane(m_blocks[lane / MK61_BATCH_WIDTH], lane % MK61_BATCH_WIDTH, state);
+}
@@ -0,0 +1,93 @@
+#ifndef MK61BATCH_H_INCLUDED
+#define MK61BATCH_H_INCLUDED
+
+#include <vector>
+#include "mk61emu.h"
+
+/**
+ * Number of calculators advanced together by one SIMD kernel
+ */
+const uint8_t MK61_BATCH_WIDTH = 8;
+
+/**
+ * IK13 state of MK61_BATCH_WIDTH calculators, each value widened to a 32-bit lane
+ */
+struct mk61_lanes_IK13
+{
+    int32_t R[IK13_MTICK_COUNT][MK61_BATCH_WIDTH];
+    int32_t M[IK13_MTICK_COUNT][MK61_BATCH_WIDTH];
+    int32_t ST[IK13_MTICK_COUNT][MK61_BATCH_WIDTH];
+    int32_t S[MK61_BATCH_WIDTH], S1[MK61_BATCH_WIDTH], L[MK61_BATCH_WIDTH], T[MK61_BATCH_WIDTH], P[MK61_BATCH_WIDTH];
+    int32_t AMK[MK61_BATCH_WIDTH], AK[MK61_BATCH_WIDTH], MOD[MK61_BATCH_WIDTH];
+    int32_t input[MK61_BATCH_WIDTH];
+    int32_t output[MK61_BATCH_WIDTH];
+    int32_t key_x[MK61_BATCH_WIDTH], key_y[MK61_BATCH_WIDTH], comma[MK61_BATCH_WIDTH];
+    int32_t key_seen[MK61_BATCH_WIDTH];
+};
+
+/**
+ * IR2 state of MK61_BATCH_WIDTH calculators
+ */
+struct mk61_lanes_IR2
+{
+    int32_t M[IR2_MTICK_COUNT][MK61_BATCH_WIDTH];
+    int32_t input[MK61_BATCH_WIDTH];
+    int32_t output[MK61_BATCH_WIDTH];
+};
+
+/**
+ * Chipset state of MK61_BATCH_WIDTH calculators in struct-of-arrays form.
+ * The chips of all calculators tick in lockstep, so mtick is kept by the batch.
+ */
+struct alignas(32) mk61_lanes_block
+{
+    mk61_lanes_IR2  IR2_1;
+    mk61_lanes_IR2  IR2_2;
+    mk61_lanes_IK13 IK1302;
+    mk61_lanes_IK13 IK1303;
+    mk61_lanes_IK13 IK1306;
+};
+
+/**
+ * Many independent MK61 calculators emulated at the microcode level in lockstep.
+ * Every calculator (lane) behaves exactly as a separate mk61_emu instance:
+ * set_key() followed by do_step() is do_key_press(), do_step() alone is do_step().
+ * The lanes are advanced by an AVX2 kernel when the CPU supports it,
+ * otherwise one by one with the regular chip emulation.
+ */
+class mk61_batch_emu
+{
+public:
+    explicit mk61_batch_emu(size_t count);
+    mk61_batch_emu(const mk61_batch_emu&) = delete;
+    mk61_batch_emu& operator =(const mk61_batch_emu&) = delete;
+public:
+    size_t size() const { return m_count; }
+    void reset();
+    void do_step();
+    void set_key(size_t lane, const uint8_t key1, const uint8_t key2);
+    angle_unit_t get_angle_unit(size_t lane) const;
+    void set_angle_unit(size_t lane, const angle_unit_t value);
+    bool is_running(size_t lane) const;
+    void get_chipset_state(size_t lane, mk61_chipset_state& state) const;
+    void set_chipset_state(size_t lane, const mk61_chipset_state& state);
+    static bool is_vectorized();
+private:
+    void check_lane(size_t lane) const;
+    static void load_chip(mk61_lanes_IK13 &c, uint8_t lane, const IK13 &chip);
+    static void store_chip(const mk61_lanes_IK13 &c, uint8_t lane, IK13 &chip);
+    static void load_chip(mk61_lanes_IR2 &c, uint8_t lane, const IR2 &chip);
+    static void store_chip(const mk61_lanes_IR2 &c, uint8_t lane, IR2 &chip);
+    void load_lane(mk61_lanes_block& block, uint8_t lane, const mk61_chipset_state& state);
+    void store_lane(const mk61_lanes_block& block, uint8_t lane, mk61_chipset_state& state) const;
+    void step_scalar(mk61_lanes_block& block, uint8_t lanes);
+private:
+    size_t m_count;
+    std::vector<mk61_lanes_block> m_blocks;
+    std::vector<angle_unit_t> m_angle_units;
+    mk61_chipset_state m_power_on_state;  // state right after power on, also supplies the ROMs
+    mtick_t m_IK13_mtick;
+    mtick_t m_IR2_mtick;
+};
+
+#endif // MK61BATCH_H_INCLUDED
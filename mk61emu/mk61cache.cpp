@@ -0,0 +1,77 @@
+#include "mk61cache.h"
+
+/*
+* mk61_step_cache
+*/
+mk61_step_cache::mk61_step_cache(size_t capacity)
+    : m_capacity(capacity)
+{
+}
+
+bool mk61_step_cache::find(const uint64_t hash, mk61_chipset_state& state)
+{
+    std::lock_guard lock(m_lock);
+    auto found = m_index.find(hash);
+    if (found == m_index.end() || memcmp(&found->second->state, &state, sizeof(state)) != 0)
+    {
+        m_misses++;
+        return false;
+    }
+    m_entries.splice(m_entries.begin(), m_entries, found->second);
+    memcpy(&state, &found->second->result, sizeof(state));
+    m_hits++;
+    return true;
+}
+
+void mk61_step_cache::insert(const uint64_t hash, const mk61_chipset_state& state, const mk61_chipset_state& result)
+{
+    std::lock_guard lock(m_lock);
+    if (m_capacity == 0)
+        return;
+    auto found = m_index.find(hash);
+    if (found != m_index.end())
+    {
+        // the same state stepped by another emulator or a hash collision
+        m_entries.splice(m_entries.begin(), m_entries, found->second);
+    }
+    else
+    {
+        if (m_entries.size() >= m_capacity)
+        {
+            m_index.erase(m_entries.back().hash);
+            m_entries.splice(m_entries.begin(), m_entries, std::prev(m_entries.end()));
+        }
+        else
+            m_entries.emplace_front();
+        m_index[hash] = m_entries.begin();
+    }
+    entry& item = m_entries.front();
+    item.hash = hash;
+    memcpy(&item.state, &state, sizeof(state));
+    memcpy(&item.result, &result, sizeof(result));
+}
+
+void mk61_step_cache::clear()
+{
+    std::lock_guard lock(m_lock);
+    m_index.clear();
+    m_entries.clear();
+}
+
+size_t mk61_step_cache::get_size()
+{
+    std::lock_guard lock(m_lock);
+    return m_entries.size();
+}
+
+uint64_t mk61_step_cache::get_hits()
+{
+    std::lock_guard lock(m_lock);
+    return m_hits;
+}
+
+uint64_t mk61_step_cache::get_misses()
+{
+    std::lock_guard lock(m_lock);
+    return m_misses;
+}
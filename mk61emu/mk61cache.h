@@ -0,0 +1,45 @@
+#ifndef MK61CACHE_H_INCLUDED
+#define MK61CACHE_H_INCLUDED
+
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include "mk61emu.h"
+
+/**
+ * Bounded LRU cache of do_step transitions: chipset state at the start of the
+ * step (the pressed key and the angle unit included) -> state at its end.
+ * Entries are found by the state hash and verified by the full state, so a hit
+ * is exact. The cache may be shared by several emulators and threads.
+ */
+class mk61_step_cache
+{
+public:
+    explicit mk61_step_cache(size_t capacity);
+    mk61_step_cache(const mk61_step_cache&) = delete;
+    mk61_step_cache& operator =(const mk61_step_cache&) = delete;
+public:
+    bool find(const uint64_t hash, mk61_chipset_state& state);
+    void insert(const uint64_t hash, const mk61_chipset_state& state, const mk61_chipset_state& result);
+    void clear();
+    size_t get_size();
+    uint64_t get_hits();
+    uint64_t get_misses();
+private:
+    struct entry
+    {
+        uint64_t hash;
+        mk61_chipset_state state;
+        mk61_chipset_state result;
+    };
+    typedef std::list<entry> entries_t;
+private:
+    std::mutex m_lock;
+    size_t m_capacity;
+    entries_t m_entries; // most recently used first
+    std::unordered_map<uint64_t, entries_t::iterator> m_index;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+};
+
+#endif // MK61CACHE_H_INCLUDED
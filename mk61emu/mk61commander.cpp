@@ -1,19 +1,38 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include <thread>
 #include <chrono>
 #include <vector>
 
 #include "mk_common.h"
 #include "mk61commander.h"
+#include "mk61history.h"
 
 /*
 * emu_runner
 */
-emu_runner::emu_runner()
-    : m_emu(std::make_unique<mk61_emu>())
-{}
+template <size_t size> static void copy_str(char (&target)[size], const char* source)
+{
+    strncpy(target, source, size - 1);
+    target[size - 1] = 0;
+}
+
+emu_runner::emu_runner(mk61_engine_kind_t engine_kind)
+{
+    if (engine_kind == mk61_engine_kind_t::opcode)
+        m_emu = std::make_unique<mk61_opcode_emu>();
+    else
+    {
+        auto emu = std::make_unique<mk61_emu>();
+        emu->set_history(std::make_shared<mk61_history>());
+        m_microcode_emu = emu.get();
+        m_emu = std::move(emu);
+    }
+    publish_unsafe();
+}
 
 emu_runner::~emu_runner()
 {
@@ -33,7 +52,13 @@ void emu_runner::start()
 
 void emu_runner::terminate()
 {
-    m_sig_term = true;
+    {
+        // under the lock, so the runner either sees it or is already waiting
+        std::lock_guard lock(m_wake_lock);
+        m_sig_term = true;
+    }
+    m_wake.notify_one();
+    m_done.notify_all();
     if (m_emu_thread->joinable())
         m_emu_thread->join();
 }
@@ -41,80 +66,331 @@ void emu_runner::terminate()
 void emu_runner::do_step_unsafe()
 {
     if (m_emu->get_power_state() == engine_power_state_t::engine_on)
-        for (int i = 0; i < 10; ++i) // Step up keys
+        for (int i = 0; i < 10; ++i) // Steps of a batch
             m_emu->do_step();
+    publish_unsafe();
 }
 
 
+uint64_t emu_runner::post(const emu_command& command)
+{
+    // the queue is full only while the emulator thread is far behind
+    while (!m_commands.push(command))
+        std::this_thread::yield();
+    wake();
+    return ++m_posted;
+}
+
+uint64_t emu_runner::post_key_press(const uint8_t key1, const uint8_t key2)
+{
+    emu_command command = {};
+    command.kind = emu_command_kind_t::key_press;
+    command.key1 = key1;
+    command.key2 = key2;
+    return post(command);
+}
+
+uint64_t emu_runner::post_input(const std::string& input)
+{
+    emu_command command = {};
+    command.kind = emu_command_kind_t::input;
+    command.input = input;
+    return post(command);
+}
+
+uint64_t emu_runner::post_power_state(const engine_power_state_t value)
+{
+    emu_command command = {};
+    command.kind = emu_command_kind_t::power_state;
+    command.power_state = value;
+    return post(command);
+}
+
+uint64_t emu_runner::post_angle_unit(const angle_unit_t value)
+{
+    emu_command command = {};
+    command.kind = emu_command_kind_t::angle_unit;
+    command.angle_unit = value;
+    return post(command);
+}
+
+void emu_runner::wait(const uint64_t ticket)
+{
+    if (m_completed >= ticket)
+        return;
+    std::unique_lock lock(m_wake_lock);
+    m_done.wait(lock, [this, ticket] { return m_completed >= ticket || m_sig_term; });
+}
+
+void emu_runner::flush()
+{
+    wait(m_posted);
+}
+
+void emu_runner::wake()
+{
+    {
+        std::lock_guard lock(m_wake_lock);
+        m_wake_pending = true;
+    }
+    m_wake.notify_one();
+}
+
+void emu_runner::execute_unsafe(const emu_command& command)
+{
+    switch (command.kind)
+    {
+    case emu_command_kind_t::key_press:
+    {
+        std::string input;
+        mk61_input_key::write(input, command.key1, command.key2);
+        m_emu->do_input(input.data(), input.size());
+        publish_unsafe();
+        break;
+    }
+    case emu_command_kind_t::input:
+        // the engine steps as long as the keys need
+        m_emu->do_input(command.input.data(), command.input.size());
+        publish_unsafe();
+        break;
+    case emu_command_kind_t::power_state:
+        m_emu->set_power_state(command.power_state);
+        publish_unsafe();
+        break;
+    case emu_command_kind_t::angle_unit:
+        m_emu->set_angle_unit(command.angle_unit);
+        publish_unsafe();
+        break;
+    }
+}
+
 mk_result_t emu_runner::do_key_press(const uint8_t key1, const uint8_t key2)
 {
-    std::lock_guard lock(m_lock);
-    auto result = m_emu->do_key_press(key1, key2);
-    do_step_unsafe();
-    return result;
+    wait(post_key_press(key1, key2));
+    return mk_result_t::mk_ok;
+}
+
+mk_result_t emu_runner::do_input(const std::string& input)
+{
+    if (!mk61_input_key::is_valid(input.data(), input.size()))
+        return mk_result_t::mk_error;
+    wait(post_input(input));
+    return mk_result_t::mk_ok;
 }
 
 angle_unit_t emu_runner::get_angle_unit()
 {
-    std::lock_guard lock(m_lock);
-    return m_emu->get_angle_unit();
+    emu_status status;
+    get_status(status);
+    return status.angle_unit;
 }
 
 engine_power_state_t emu_runner::get_power_state()
 {
-    std::lock_guard lock(m_lock);
-    return m_emu->get_power_state();
+    emu_status status;
+    get_status(status);
+    return status.power_state;
 }
 
 std::string emu_runner::get_prog_counter_str()
 {
-    std::lock_guard lock(m_lock);
-    return m_emu->get_prog_counter_str();
+    emu_status status;
+    get_status(status);
+    return status.prog_counter;
 }
 
 std::string emu_runner::get_reg_mem_str(const mk61emu_reg_mem_t reg)
 {
-    std::lock_guard lock(m_lock);
-    return m_emu->get_reg_mem_str(reg);
+    emu_status status;
+    get_status(status);
+    return status.reg_mem[static_cast<int>(reg)];
 }
 
 std::string emu_runner::get_reg_stack_str(const mk61emu_reg_stack_t reg)
 {
+    emu_status status;
+    get_status(status);
+    return status.reg_stack[static_cast<int>(reg)];
+}
+
+mk61_number emu_runner::get_reg_mem(const mk61emu_reg_mem_t reg)
+{
+    flush();
     std::lock_guard lock(m_lock);
-    return m_emu->get_reg_stack_str(reg);
+    return m_emu->get_reg_mem(reg);
 }
 
-bool emu_runner::is_emu_running()
+mk61_number emu_runner::get_reg_stack(const mk61emu_reg_stack_t reg)
 {
+    flush();
     std::lock_guard lock(m_lock);
-    return m_emu->is_running();
+    return m_emu->get_reg_stack(reg);
 }
 
-void emu_runner::set_angle_unit(angle_unit_t value)
+void emu_runner::get_program(mk61_program_t& image)
 {
+    flush();
     std::lock_guard lock(m_lock);
-    m_emu->set_angle_unit(value);
+    m_emu->get_program(image);
+}
+
+void emu_runner::set_program(const mk61_program_t& image)
+{
+    flush();
+    {
+        std::lock_guard lock(m_lock);
+        m_emu->set_program(image);
+        publish_unsafe();
+    }
+    wake();
+}
+
+bool emu_runner::is_emu_running()
+{
+    emu_status status;
+    get_status(status);
+    return status.running;
+}
+
+void emu_runner::set_angle_unit(angle_unit_t value)
+{
+    wait(post_angle_unit(value));
 }
 
 void emu_runner::set_power_state(engine_power_state_t value)
 {
+    wait(post_power_state(value));
+}
+
+mk61_emu& emu_runner::history_emu()
+{
+    if (!m_microcode_emu)
+        throw std::logic_error("History of the steps is kept by the microcode engine only");
+    return *m_microcode_emu;
+}
+
+uint64_t emu_runner::get_step_count()
+{
+    flush();
     std::lock_guard lock(m_lock);
-    m_emu->set_power_state(value);
+    return history_emu().get_step_count();
 }
 
+void emu_runner::step_back(const uint64_t count)
+{
+    flush();
+    {
+        std::lock_guard lock(m_lock);
+        history_emu().step_back(count);
+        publish_unsafe();
+    }
+    wake();
+}
+
+void emu_runner::go_to_step(const uint64_t step)
+{
+    flush();
+    {
+        std::lock_guard lock(m_lock);
+        history_emu().go_to_step(step);
+        publish_unsafe();
+    }
+    wake();
+}
+
+bool emu_runner::wait_stopped(const uint64_t max_steps, uint64_t& steps)
+{
+    flush();
+    bool stopped;
+    {
+        // stepped here rather than by the emulator thread, so the simulated delay does not count
+        std::lock_guard lock(m_lock);
+        steps = 0;
+        // until the calculator waits for a key: a program that has just stopped still updates the counter
+        while (has_work_unsafe() && steps < max_steps)
+        {
+            m_emu->do_step();
+            steps++;
+        }
+        stopped = !has_work_unsafe();
+        publish_unsafe();
+    }
+    wake();
+    return stopped;
+}
+
+void emu_runner::get_status(emu_status& status) const
+{
+    uint32_t sequence;
+    do
+    {
+        sequence = m_status_sequence.load(std::memory_order_acquire);
+        memcpy(&status, &m_status, sizeof(status));
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    while ((sequence & 1) != 0 || sequence != m_status_sequence.load(std::memory_order_relaxed));
+}
+
+void emu_runner::publish_unsafe()
+{
+    // the status is prepared first, so the readers retry for the copy only
+    emu_status status;
+    status.power_state = m_emu->get_power_state();
+    status.angle_unit = m_emu->get_angle_unit();
+    status.running = m_emu->is_running();
+    for (int i = 0; i < MK61EMU_REG_STACK_COUNT; i++)
+        copy_str(status.reg_stack[i], m_emu->get_reg_stack_str(static_cast<mk61emu_reg_stack_t>(i)));
+    for (int i = 0; i < MK61EMU_REG_MEM_COUNT; i++)
+        copy_str(status.reg_mem[i], m_emu->get_reg_mem_str(static_cast<mk61emu_reg_mem_t>(i)));
+    copy_str(status.prog_counter, m_emu->get_prog_counter_str());
+    for (uint8_t i = 0; i < MK61EMU_RETURNS_COUNT; i++)
+        copy_str(status.returns[i], m_emu->get_return_str(i));
+    copy_str(status.indicator, m_emu->get_indicator_str());
+    status.input_ticks = m_microcode_emu ? m_microcode_emu->get_input_ticks() : 0;
+    const uint32_t sequence = m_status_sequence.load(std::memory_order_relaxed);
+    m_status_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&m_status, &status, sizeof(status));
+    m_status_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+bool emu_runner::has_work_unsafe()
+{
+    return m_emu->get_power_state() == engine_power_state_t::engine_on && !m_emu->is_idle();
+}
 
 void emu_runner::internal_run()
 {
+    std::unique_lock wake_lock(m_wake_lock);
     while (!m_sig_term)
     {
-        // Make a step when calculator in the running mode
-        if (m_emu->get_power_state() == engine_power_state_t::engine_on && m_emu->is_running())
+        // Sleep until a command gives the calculator something to do
+        m_wake.wait(wake_lock, [this] { return m_sig_term || m_wake_pending || m_has_work; });
+        if (m_sig_term)
+            break;
+        m_wake_pending = false;
+        wake_lock.unlock();
         {
             std::lock_guard lock(m_lock);
-            do_step_unsafe();
+            emu_command command;
+            bool executed = false;
+            while (m_commands.pop(command))
+            {
+                execute_unsafe(command);
+                executed = true;
+                {
+                    std::lock_guard done_lock(m_wake_lock);
+                    m_completed++;
+                }
+                m_done.notify_all();
+            }
+            if (!executed && has_work_unsafe())
+                do_step_unsafe();
+            m_has_work = has_work_unsafe();
         }
-        if (m_simulate_delay)
-            std::this_thread::sleep_for(std::chrono::milliseconds(100)); // Simulate a delay between steps (macro ticks)
+        wake_lock.lock();
+        if (m_has_work && m_simulate_delay)
+            m_wake.wait_for(wake_lock, std::chrono::milliseconds(100), [this] { return m_sig_term || m_wake_pending; }); // Simulate a delay between steps (macro ticks)
     }
 }
 
@@ -141,6 +417,13 @@ std::string mk_key_coord::to_string() const
 /*
 * mk_instruction_keys
 */
+mk_instruction_keys::mk_instruction_keys(mk_instruction instruction, std::vector<mk_key_coord> keys)
+    : m_instruction(instruction), m_keys(keys)
+{
+    for (const auto& key : m_keys)
+        mk61_input_key::write(m_input, key.key1(), key.key2());
+}
+
 std::string mk_instruction_keys::keys_to_string() const
 {
     std::stringstream ss;
@@ -160,10 +443,10 @@ std::string instruction_index::make_key(const std::string& mnemonics)
     return strutils::to_upper(mnemonics);
 }
 
-mk_instruction_keys_sptr instruction_index::find(const std::string& mnemonics) const
+mk_instruction_keys_sptr instruction_index::find(std::string_view mnemonics) const
 {
-    const std::string key = make_key(mnemonics);
-    auto iter = m_index.find(key);
+    // the index ignores the case, so the token is looked up as it is
+    auto iter = m_index.find(mnemonics);
     if (iter != m_index.end())
         return iter->second;
     return mk_instruction_keys_sptr();
@@ -217,6 +500,37 @@ void instruction_index::check_keys_not_exist(std::vector<mk_key_coord> keys)
     }
 }
 
+void instruction_index::check_codes() const
+{
+    const mk_instruction_keys_sptr prg = find("PRG");
+    std::stringstream errors;
+    mk61_emu microcode_emu;
+    mk61_opcode_emu opcode_emu;
+    mk61_engine* engines[] = { &microcode_emu, &opcode_emu };
+    const char* engine_names[] = { "microcode", "opcode" };
+    for (const auto& instr_keys : m_data)
+    {
+        const int32_t code = instr_keys->instruction().code();
+        if (code == mk_instruction::no_code)
+            continue;
+        const std::string input = prg->input() + instr_keys->input();
+        for (int i = 0; i < 2; i++)
+        {
+            // switched on again for every instruction, so it is stored at step 00
+            engines[i]->set_power_state(engine_power_state_t::engine_off);
+            engines[i]->set_power_state(engine_power_state_t::engine_on);
+            engines[i]->do_input(input.data(), input.size());
+            mk61_program_t image;
+            engines[i]->get_program(image);
+            if (image[0] != code)
+                errors << "\n" << instr_keys->instruction().mnemonics() << std::hex << std::uppercase
+                    << ": " << code << " stored as " << static_cast<int>(image[0]) << std::dec
+                    << " by the " << engine_names[i] << " engine";
+        }
+    }
+    if (!errors.str().empty())
+        throw std::logic_error("Instruction codes do not match" + errors.str());
+}
 
 void instruction_index::init()
 {
@@ -258,14 +572,14 @@ void instruction_index::init()
     add_instr(0x23, "1/x", "inversion of X", { {11, 9}, {5, 8} }, { "INV" });
     add_instr(0x24, "X^Y", "power of X", { {11, 9}, {6, 8} });
     add_instr(0x25, "R", "Roll down stack", { {11, 9}, {7, 8} });
-    add_instr(0x26, "M-D", "HM to degrees", { {10, 9}, {8, 1} });
+    add_instr(0x26, "M-D", "HM to degrees", { {10, 9}, {2, 8} });
     // Skip 0x27..29
-    add_instr(0x2A, "MS-D", "MS to degree", { {10, 9}, {5, 1} });
+    add_instr(0x2A, "MS-D", "MS to degree", { {10, 9}, {6, 8} });
     // Skip 0x2B..2F
-    add_instr(0x30, "D-MS", "degrees to MS", { {10, 9}, {6, 8} });
+    add_instr(0x30, "D-MS", "degrees to MS", { {10, 9}, {5, 1} });
     add_instr(0x31, "ABS", "absolute value", { {10, 9}, {6, 1} }, { "|x|" });
     add_instr(0x32, "SGN", "sign of X", { {10, 9}, {7, 1} });
-    add_instr(0x33, "D-M", "degrees to M", { {10, 9}, {2, 8} });
+    add_instr(0x33, "D-M", "degrees to M", { {10, 9}, {8, 1} });
     add_instr(0x34, "INT", "integer part", { {10, 9}, {9, 1} }, { "[x]" });
     add_instr(0x35, "FRAC", "fractional part", { {10, 9}, {10, 1} }, { "{x}" });
     add_instr(0x36, "MAX", "max of X and Y", { {10, 9}, {11, 1} });
@@ -301,10 +615,10 @@ void instruction_index::init()
     add_instr(0x58, "L2", "loop on R2", { {11, 9}, {3, 9} });
     add_instr(0x59, "x>=0", "check RX greater or equal to 0", { {11, 9}, {4, 9} }, { "xGE0" });
     add_instr(0x5A, "L3", "loop on R3", { {11, 9}, {5, 9} });
-    add_instr(0x58, "L1", "loop on R1", { {11, 9}, {6, 9} });
-    add_instr(0x5C, "x<0", "check RX less than 0", { {11, 9}, {9, 9} }, { "xLT0" });
+    add_instr(0x5B, "L1", "loop on R1", { {11, 9}, {6, 9} });
+    add_instr(0x5C, "x<0", "check RX less than 0", { {11, 9}, {7, 9} }, { "xLT0" });
     add_instr(0x5D, "L0", "loop on R0", { {11, 9}, {8, 9} });
-    add_instr(0x5E, "x=0", "check RX equal to 0", { {11, 9}, {7, 9} }, { "xEQ0" });
+    add_instr(0x5E, "x=0", "check RX equal to 0", { {11, 9}, {9, 9} }, { "xEQ0" });
     // Skip 0x5F
     add_instr(0x60, "MR0", "recall memory register R0 to RX", { {8, 9}, {2, 1} }, { "RCL0" });
     add_instr(0x61, "MR1", "recall memory register R1 to RX", { {8, 9}, {3, 1} }, { "RCL1" });
@@ -360,7 +674,7 @@ void instruction_index::init()
     add_instr(0x93, "Kx>=03", "check x>=0, indirect jump by R3", { {10, 9}, {4, 9}, {5, 1} });
     add_instr(0x94, "Kx>=04", "check x>=0, indirect jump by R4", { {10, 9}, {4, 9}, {6, 1} });
     add_instr(0x95, "Kx>=05", "check x>=0, indirect jump by R5", { {10, 9}, {4, 9}, {7, 1} });
-    add_instr(0x66, "Kx>=06", "check x>=0, indirect jump by R6", { {10, 9}, {4, 9}, {8, 1} });
+    add_instr(0x96, "Kx>=06", "check x>=0, indirect jump by R6", { {10, 9}, {4, 9}, {8, 1} });
     add_instr(0x97, "Kx>=07", "check x>=0, indirect jump by R7", { {10, 9}, {4, 9}, {9, 1} });
     add_instr(0x98, "Kx>=08", "check x>=0, indirect jump by R8", { {10, 9}, {4, 9}, {10, 1} });
     add_instr(0x99, "Kx>=09", "check x>=0, indirect jump by R9", { {10, 9}, {4, 9}, {11, 1} });
@@ -402,21 +716,21 @@ void instruction_index::init()
     add_instr(0xBD, "KMD", "indirect store to memory by RD", { {10, 9}, {6, 9}, {10, 8} }, { "KMSD", "KSTOD" });
     add_instr(0xBE, "KME", "indirect store to memory by RE", { {10, 9}, {6, 9}, {11, 8} }, { "KMSE", "KSTOE" });
     // Skip 0xBF
-    add_instr(0xC0, "Kx<00", "check x<0, indirect jump by R0", { {10, 9}, {9, 9}, {2, 1} });
-    add_instr(0xC1, "Kx<01", "check x<0, indirect jump by R1", { {10, 9}, {9, 9}, {3, 1} });
-    add_instr(0xC2, "Kx<02", "check x<0, indirect jump by R2", { {10, 9}, {9, 9}, {4, 1} });
-    add_instr(0xC3, "Kx<03", "check x<0, indirect jump by R3", { {10, 9}, {9, 9}, {5, 1} });
-    add_instr(0xC4, "Kx<04", "check x<0, indirect jump by R4", { {10, 9}, {9, 9}, {6, 1} });
-    add_instr(0xC5, "Kx<05", "check x<0, indirect jump by R5", { {10, 9}, {9, 9}, {7, 1} });
-    add_instr(0xC6, "Kx<06", "check x<0, indirect jump by R6", { {10, 9}, {9, 9}, {8, 1} });
-    add_instr(0xC7, "Kx<07", "check x<0, indirect jump by R7", { {10, 9}, {9, 9}, {9, 1} });
-    add_instr(0xC8, "Kx<08", "check x<0, indirect jump by R8", { {10, 9}, {9, 9}, {10, 1} });
-    add_instr(0xC9, "Kx<09", "check x<0, indirect jump by R9", { {10, 9}, {9, 9}, {11, 1} });
-    add_instr(0xCA, "Kx<0A", "check x<0, indirect jump by RA", { {10, 9}, {9, 9}, {7, 8} });
-    add_instr(0xCB, "Kx<0B", "check x<0, indirect jump by RB", { {10, 9}, {9, 9}, {8, 8} });
-    add_instr(0xCC, "Kx<0C", "check x<0, indirect jump by RC", { {10, 9}, {9, 9}, {9, 8} });
-    add_instr(0xCD, "Kx<0D", "check x<0, indirect jump by RD", { {10, 9}, {9, 9}, {10, 8} });
-    add_instr(0xCE, "Kx<0E", "check x<0, indirect jump by RE", { {10, 9}, {9, 9}, {11, 8} });
+    add_instr(0xC0, "Kx<00", "check x<0, indirect jump by R0", { {10, 9}, {7, 9}, {2, 1} });
+    add_instr(0xC1, "Kx<01", "check x<0, indirect jump by R1", { {10, 9}, {7, 9}, {3, 1} });
+    add_instr(0xC2, "Kx<02", "check x<0, indirect jump by R2", { {10, 9}, {7, 9}, {4, 1} });
+    add_instr(0xC3, "Kx<03", "check x<0, indirect jump by R3", { {10, 9}, {7, 9}, {5, 1} });
+    add_instr(0xC4, "Kx<04", "check x<0, indirect jump by R4", { {10, 9}, {7, 9}, {6, 1} });
+    add_instr(0xC5, "Kx<05", "check x<0, indirect jump by R5", { {10, 9}, {7, 9}, {7, 1} });
+    add_instr(0xC6, "Kx<06", "check x<0, indirect jump by R6", { {10, 9}, {7, 9}, {8, 1} });
+    add_instr(0xC7, "Kx<07", "check x<0, indirect jump by R7", { {10, 9}, {7, 9}, {9, 1} });
+    add_instr(0xC8, "Kx<08", "check x<0, indirect jump by R8", { {10, 9}, {7, 9}, {10, 1} });
+    add_instr(0xC9, "Kx<09", "check x<0, indirect jump by R9", { {10, 9}, {7, 9}, {11, 1} });
+    add_instr(0xCA, "Kx<0A", "check x<0, indirect jump by RA", { {10, 9}, {7, 9}, {7, 8} });
+    add_instr(0xCB, "Kx<0B", "check x<0, indirect jump by RB", { {10, 9}, {7, 9}, {8, 8} });
+    add_instr(0xCC, "Kx<0C", "check x<0, indirect jump by RC", { {10, 9}, {7, 9}, {9, 8} });
+    add_instr(0xCD, "Kx<0D", "check x<0, indirect jump by RD", { {10, 9}, {7, 9}, {10, 8} });
+    add_instr(0xCE, "Kx<0E", "check x<0, indirect jump by RE", { {10, 9}, {7, 9}, {11, 8} });
     // Skip 0xCF
     add_instr(0xD0, "KMR0", "indirect recall from memory by R0", { {10, 9}, {8, 9}, {2, 1} }, { "KRCL0" });
     add_instr(0xD1, "KMR1", "indirect recall from memory by R1", { {10, 9}, {8, 9}, {3, 1} }, { "KRCL1" });
@@ -434,21 +748,21 @@ void instruction_index::init()
     add_instr(0xDD, "KMRD", "indirect recall from memory by RD", { {10, 9}, {8, 9}, {10, 8} }, { "KRCLD" });
     add_instr(0xDE, "KMRE", "indirect recall from memory by RE", { {10, 9}, {8, 9}, {11, 8} }, { "KRCLE" });
     // Skip 0xDF
-    add_instr(0xE0, "Kx=00", "check x=0, indirect jump by R0", { {10, 9}, {7, 9}, {2, 1} });
-    add_instr(0xE1, "Kx=01", "check x=0, indirect jump by R1", { {10, 9}, {7, 9}, {3, 1} });
-    add_instr(0xE2, "Kx=02", "check x=0, indirect jump by R2", { {10, 9}, {7, 9}, {4, 1} });
-    add_instr(0xE3, "Kx=03", "check x=0, indirect jump by R3", { {10, 9}, {7, 9}, {5, 1} });
-    add_instr(0xE4, "Kx=04", "check x=0, indirect jump by R4", { {10, 9}, {7, 9}, {6, 1} });
-    add_instr(0xE5, "Kx=05", "check x=0, indirect jump by R5", { {10, 9}, {7, 9}, {7, 1} });
-    add_instr(0xE6, "Kx=06", "check x=0, indirect jump by R6", { {10, 9}, {7, 9}, {8, 1} });
-    add_instr(0xE7, "Kx=07", "check x=0, indirect jump by R7", { {10, 9}, {7, 9}, {9, 1} });
-    add_instr(0xE8, "Kx=08", "check x=0, indirect jump by R8", { {10, 9}, {7, 9}, {10, 1} });
-    add_instr(0xE9, "Kx=09", "check x=0, indirect jump by R9", { {10, 9}, {7, 9}, {11, 1} });
-    add_instr(0xEA, "Kx=0A", "check x=0, indirect jump by RA", { {10, 9}, {7, 9}, {7, 8} });
-    add_instr(0xEB, "Kx=0B", "check x=0, indirect jump by RB", { {10, 9}, {7, 9}, {8, 8} });
-    add_instr(0xEC, "Kx=0C", "check x=0, indirect jump by RC", { {10, 9}, {7, 9}, {9, 8} });
-    add_instr(0xED, "Kx=0D", "check x=0, indirect jump by RD", { {10, 9}, {7, 9}, {10, 8} });
-    add_instr(0xEE, "Kx=0E", "check x=0, indirect jump by RE", { {10, 9}, {7, 9}, {11, 8} });
+    add_instr(0xE0, "Kx=00", "check x=0, indirect jump by R0", { {10, 9}, {9, 9}, {2, 1} });
+    add_instr(0xE1, "Kx=01", "check x=0, indirect jump by R1", { {10, 9}, {9, 9}, {3, 1} });
+    add_instr(0xE2, "Kx=02", "check x=0, indirect jump by R2", { {10, 9}, {9, 9}, {4, 1} });
+    add_instr(0xE3, "Kx=03", "check x=0, indirect jump by R3", { {10, 9}, {9, 9}, {5, 1} });
+    add_instr(0xE4, "Kx=04", "check x=0, indirect jump by R4", { {10, 9}, {9, 9}, {6, 1} });
+    add_instr(0xE5, "Kx=05", "check x=0, indirect jump by R5", { {10, 9}, {9, 9}, {7, 1} });
+    add_instr(0xE6, "Kx=06", "check x=0, indirect jump by R6", { {10, 9}, {9, 9}, {8, 1} });
+    add_instr(0xE7, "Kx=07", "check x=0, indirect jump by R7", { {10, 9}, {9, 9}, {9, 1} });
+    add_instr(0xE8, "Kx=08", "check x=0, indirect jump by R8", { {10, 9}, {9, 9}, {10, 1} });
+    add_instr(0xE9, "Kx=09", "check x=0, indirect jump by R9", { {10, 9}, {9, 9}, {11, 1} });
+    add_instr(0xEA, "Kx=0A", "check x=0, indirect jump by RA", { {10, 9}, {9, 9}, {7, 8} });
+    add_instr(0xEB, "Kx=0B", "check x=0, indirect jump by RB", { {10, 9}, {9, 9}, {8, 8} });
+    add_instr(0xEC, "Kx=0C", "check x=0, indirect jump by RC", { {10, 9}, {9, 9}, {9, 8} });
+    add_instr(0xED, "Kx=0D", "check x=0, indirect jump by RD", { {10, 9}, {9, 9}, {10, 8} });
+    add_instr(0xEE, "Kx=0E", "check x=0, indirect jump by RE", { {10, 9}, {9, 9}, {11, 8} });
     // Skip 0xEF..FF
     // Modes
     add_instr(mk_instruction::no_code, "AUT", "calculation mode", { {11, 9}, {8, 8} });
@@ -459,105 +773,226 @@ void instruction_index::init()
 
 
 /*
-* mk61_commander
+* mk_tokenizer
 */
-mk61_commander::mk61_commander()
+bool mk_tokenizer::next(std::string_view& token)
 {
-    m_instructions.init();
+    const size_t start = m_text.find_first_not_of(" \t", m_position);
+    if (start == std::string_view::npos)
+    {
+        m_position = m_text.size();
+        return false;
+    }
+    const size_t end = std::min(m_text.find_first_of(" \t", start), m_text.size());
+    token = m_text.substr(start, end - start);
+    m_position = end;
+    return true;
 }
 
-strings_t mk61_commander::parse_cmdline(const std::string& cmdline)
+
+/*
+* mk61_commander
+*/
+mk61_commander::mk61_commander(mk61_engine_kind_t engine_kind)
+    : m_engine_kind(engine_kind)
 {
-    std::istringstream ss(cmdline);
-    std::string token;
-    strings_t result;
-    while (std::getline(ss, token, ' '))
-    {
-        result.push_back(token);
-    }
-    return result;
+    m_instructions.init();
 }
 
 void mk61_commander::run()
 {
-    const std::string default_file_ext = ".mk61";
-    bool quit = false;
     show_short_help();
-    m_runner = std::make_unique<emu_runner>();
+    m_runner = std::make_unique<emu_runner>(m_engine_kind);
     m_runner->start();
-    while (!quit)
+    std::string cmdline;
+    do
     {
+        submit_keys();
+        m_runner->flush();
         output_display();
         //output_state();
-        std::string cmdline;
-        std::getline(std::cin, cmdline);
-        strings_t commands = parse_cmdline(cmdline);
-        for (size_t i = 0; i < commands.size(); ++i)
+    }
+    while (std::getline(std::cin, cmdline) && execute_cmdline(cmdline));
+    std::cout << std::endl;
+}
+
+void mk61_commander::run_script(std::istream& script)
+{
+    m_script = true;
+    m_runner = std::make_unique<emu_runner>(m_engine_kind);
+    m_runner->set_simulate_delay(false);
+    m_runner->start();
+    std::string cmdline;
+    while (std::getline(script, cmdline))
+    {
+        if (!cmdline.empty() && cmdline.back() == '\r')
+            cmdline.pop_back();
+        if (!execute_cmdline(cmdline))
+            break;
+    }
+    submit_keys();
+    m_runner->flush();
+    std::cout.flush();
+}
+
+bool mk61_commander::execute_cmdline(const std::string& cmdline)
+{
+    static const std::string default_file_ext = ".mk61";
+    static const std::string program_file_ext = ".mk61p";
+    bool quit = false;
+    mk_tokenizer tokens(cmdline);
+    std::string_view cmd, argument;
+    while (tokens.next(cmd))
+    {
+        mk_parse_result parse_result = parse_input(cmd);
+        if (parse_result.parsed == true)
         {
-            std::string cmd = commands[i];
-            mk_parse_result parse_result = parse_input(cmd);
-            if (parse_result.parsed == true)
+            mk61emu_result result;
+            switch (parse_result.cmd_kind)
             {
-                mk61emu_result result;
-                switch (parse_result.cmd_kind)
+            case mk_cmd_kind_t::cmd_quit:
+                quit = true;
+                break;
+            case mk_cmd_kind_t::cmd_off:
+                m_runner->set_power_state(engine_power_state_t::engine_off);
+                break;
+            case mk_cmd_kind_t::cmd_on:
+                m_runner->set_power_state(engine_power_state_t::engine_on);
+                break;
+            case mk_cmd_kind_t::cmd_output_state:
+                output_state();
+                break;
+            case mk_cmd_kind_t::cmd_help:
+                if (!m_script)
+                    show_help();
+                break;
+            case mk_cmd_kind_t::cmd_load:
+            case mk_cmd_kind_t::cmd_save:
+            {
+                if (!tokens.next(argument))
                 {
-                case mk_cmd_kind_t::cmd_quit:
-                    quit = true;
-                    break;
-                case mk_cmd_kind_t::cmd_off:
-                    m_runner->set_power_state(engine_power_state_t::engine_off);
-                    break;
-                case mk_cmd_kind_t::cmd_on:
-                    m_runner->set_power_state(engine_power_state_t::engine_on);
+                    show_message(mk_message_t::msg_error, "Filename expected");
                     break;
-                case mk_cmd_kind_t::cmd_output_state:
-                    output_state();
-                    break;
-                case mk_cmd_kind_t::cmd_help:
-                    show_help();
+                }
+                // TODO check filename
+                std::string filename = std::string(argument) + default_file_ext;
+                try
+                {
+                    if (parse_result.cmd_kind == mk_cmd_kind_t::cmd_save)
+                    {
+                        save_state(filename);
+                        show_message(mk_message_t::msg_info, "State saved");
+                    }
+                    else
+                    {
+                        load_state(filename);
+                        show_message(mk_message_t::msg_info, "State loaded");
+                    }
+                }
+                catch (std::exception& e)
+                {
+                    show_message(mk_message_t::msg_error, e.what());
+                }
+                break;
+            }
+            case mk_cmd_kind_t::cmd_program_load:
+            case mk_cmd_kind_t::cmd_program_save:
+            {
+                if (!tokens.next(argument))
+                {
+                    show_message(mk_message_t::msg_error, "Filename expected");
                     break;
-                case mk_cmd_kind_t::cmd_load:
-                case mk_cmd_kind_t::cmd_save:
+                }
+                std::string filename = std::string(argument) + program_file_ext;
+                try
                 {
-                    if (i == commands.size() - 1)
+                    if (parse_result.cmd_kind == mk_cmd_kind_t::cmd_program_save)
                     {
-                        show_message(mk_message_t::msg_error, "Filename expected");
-                        break;
+                        save_program(filename);
+                        show_message(mk_message_t::msg_info, "Program saved");
+                    }
+                    else
+                    {
+                        load_program(filename);
+                        show_message(mk_message_t::msg_info, "Program loaded");
                     }
-                    std::string filename = commands[++i];
-                    // TODO check filename
-                    filename += default_file_ext;
+                }
+                catch (std::exception& e)
+                {
+                    show_message(mk_message_t::msg_error, e.what());
+                }
+                break;
+            }
+            case mk_cmd_kind_t::cmd_back:
+            case mk_cmd_kind_t::cmd_seek:
+            {
+                if (!tokens.next(argument))
+                {
+                    show_message(mk_message_t::msg_error, "Step count expected");
+                    break;
+                }
+                try
+                {
+                    const uint64_t value = std::stoull(std::string(argument));
+                    if (parse_result.cmd_kind == mk_cmd_kind_t::cmd_back)
+                        m_runner->step_back(value);
+                    else
+                        m_runner->go_to_step(value);
+                    show_message(mk_message_t::msg_info, "Step " + std::to_string(m_runner->get_step_count()));
+                }
+                catch (std::exception& e)
+                {
+                    show_message(mk_message_t::msg_error, e.what());
+                }
+                break;
+            }
+            case mk_cmd_kind_t::cmd_wait:
+            {
+                // the step count is optional, so the next token is taken if it is a number only
+                uint64_t max_steps = MK61_WAIT_STEPS;
+                mk_tokenizer rest = tokens;
+                if (rest.next(argument) && !argument.empty()
+                    && std::all_of(argument.begin(), argument.end(), [](char c) { return c >= '0' && c <= '9'; }))
+                {
+                    tokens = rest;
                     try
                     {
-                        if (parse_result.cmd_kind == mk_cmd_kind_t::cmd_save)
-                        {
-                            save_state(filename);
-                            show_message(mk_message_t::msg_info, "State saved");
-                        }
-                        else
-                        {
-                            load_state(filename);
-                            show_message(mk_message_t::msg_info, "State loaded");
-                        }
+                        max_steps = std::stoull(std::string(argument));
                     }
                     catch (std::exception& e)
                     {
                         show_message(mk_message_t::msg_error, e.what());
+                        break;
                     }
-                    break;
-                }
-                case mk_cmd_kind_t::cmd_keys:
-                case mk_cmd_kind_t::cmd_unknown:
-                case mk_cmd_kind_t::cmd_mode:
-                case mk_cmd_kind_t::cmd_empty:
-                    break;
                 }
+                uint64_t steps;
+                if (m_runner->wait_stopped(max_steps, steps))
+                    show_message(mk_message_t::msg_info, "Stopped after " + std::to_string(steps) + " steps");
+                else
+                    show_message(mk_message_t::msg_warn, "Still running after " + std::to_string(steps) + " steps");
+                break;
             }
-            if (quit)
+            case mk_cmd_kind_t::cmd_keys:
+            case mk_cmd_kind_t::cmd_unknown:
+            case mk_cmd_kind_t::cmd_mode:
+            case mk_cmd_kind_t::cmd_empty:
                 break;
+            }
         }
+        else if (m_script)
+            show_message(mk_message_t::msg_error, "Unknown command " + std::string(cmd));
+        if (quit)
+            break;
     }
-    std::cout << std::endl;
+    return !quit;
+}
+
+void mk61_commander::submit_keys()
+{
+    if (m_keys.empty())
+        return;
+    m_runner->post_input(m_keys);
+    m_keys.clear();
 }
 
 void mk61_commander::load_state(const std::string& filename)
@@ -572,8 +1007,36 @@ void mk61_commander::save_state(const std::string& filename)
     //m_emu->get_state(data);
 }
 
+void mk61_commander::load_program(const std::string& filename)
+{
+    std::ifstream data(filename, std::ifstream::binary);
+    if (!data)
+        throw std::logic_error("Cannot open " + filename);
+    // A shorter image leaves the rest of the program memory empty
+    mk61_program_t image = {};
+    data.read(reinterpret_cast<char*>(image), sizeof(image));
+    if (data.gcount() == sizeof(image) && data.peek() != std::ifstream::traits_type::eof())
+        throw std::logic_error("Program image is longer than " + std::to_string(MK61_PROGRAM_SIZE) + " steps");
+    m_runner->set_program(image);
+}
+
+void mk61_commander::save_program(const std::string& filename)
+{
+    mk61_program_t image;
+    m_runner->get_program(image);
+    std::ofstream data(filename, std::ofstream::binary);
+    if (!data.write(reinterpret_cast<const char*>(image), sizeof(image)))
+        throw std::logic_error("Cannot write " + filename);
+}
+
 void mk61_commander::show_message(const mk_message_t message_type, const std::string message)
 {
+    if (m_script)
+    {
+        const char* kinds[] = { "info", "warning", "error" };
+        std::cout << "{\"" << kinds[static_cast<int>(message_type)] << "\": " << json_string(message) << "}\n";
+        return;
+    }
     switch (message_type)
     {
     case mk_message_t::msg_info:
@@ -634,6 +1097,11 @@ void mk61_commander::show_short_help()
         //<< "    SAVE <filename> to save calculator state (program, memory...) to file\n"
         //<< "    LOAD <filename> to restore calculator state from file\n"
         << "    STATE to show calculator state\n"
+        << "    PLOAD <filename> to load a program image (a code per step, up to 105 bytes) to program memory\n"
+        << "    PSAVE <filename> to save program memory as a 105-byte image\n"
+        << "    BACK <count> to undo the last steps of the calculator\n"
+        << "    SEEK <step> to go to the step by its number since power on\n"
+        << "    WAIT [steps] to run until the program stops, " << MK61_WAIT_STEPS << " steps at most by default\n"
         << "Setting the angular mode:\n"
         << "    DEG sets degree mode, which uses decimal degrees rather than hexagesimal degrees (degrees, minutes, seconds)\n"
         << "    RAD sets radian mode\n"
@@ -643,26 +1111,18 @@ void mk61_commander::show_short_help()
 
 void mk61_commander::output_state()
 {
+    if (m_script)
+    {
+        output_state_record();
+        return;
+    }
     clear_screen();
-    if (m_runner->get_power_state() == engine_power_state_t::engine_on)
+    emu_status status;
+    m_runner->flush();
+    m_runner->get_status(status);
+    if (status.power_state == engine_power_state_t::engine_on)
     {
-        std::cout << "ON\t\tAngle: ";
-        switch (m_runner->get_angle_unit())
-        {
-        case angle_unit_t::radian:
-            std::cout << "RAD";
-            break;
-        case angle_unit_t::grade:
-            std::cout << "GRD";
-            break;
-        case angle_unit_t::degree:
-            std::cout << "DEG";
-            break;
-        default:
-            std::cout << "?";
-            break;
-        }
-        std::cout << std::endl;
+        std::cout << "ON\t\tAngle: " << angle_unit_name(status.angle_unit) << std::endl;
 
     }
     else
@@ -670,39 +1130,102 @@ void mk61_commander::output_state()
         std::cout << "OFF" << std::endl;
     }
     std::cout << "\n"
-        << "R0: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R0)
-        << " | R1: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R1)
-        << " | R2: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R2)
-        << " | R3: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R3)
+        << "R0: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R0)]
+        << " | R1: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R1)]
+        << " | R2: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R2)]
+        << " | R3: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R3)]
         << "\n"
-        << "R4: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R4)
-        << " | R5: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R5)
-        << " | R6: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R6)
+        << "R4: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R4)]
+        << " | R5: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R5)]
+        << " | R6: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R6)]
         << "\n"
-        << "R7: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R7)
-        << " | R8: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R8)
-        << " | R9: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_R9)
-        << " | RA: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_RA)
+        << "R7: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R7)]
+        << " | R8: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R8)]
+        << " | R9: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_R9)]
+        << " | RA: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_RA)]
         << "\n"
-        << "RB: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_RB)
-        << " | RC: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_RC)
-        << " | RD: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_RD)
-        << " | RE: " << m_runner->get_reg_mem_str(mk61emu_reg_mem_t::mk61emu_RE)
+        << "RB: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_RB)]
+        << " | RC: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_RC)]
+        << " | RD: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_RD)]
+        << " | RE: " << status.reg_mem[static_cast<int>(mk61emu_reg_mem_t::mk61emu_RE)]
         << "\n\n"
-        << " T: '" << m_runner->get_reg_stack_str(mk61emu_reg_stack_t::RT)
-        << "'\tCounter: " << m_runner->get_prog_counter_str()
-        << "\tRunning: " << (m_runner->is_emu_running() ? "yes" : "no")
+        << " T: '" << status.reg_stack[static_cast<int>(mk61emu_reg_stack_t::RT)]
+        << "'\tCounter: " << status.prog_counter
+        << "\tRunning: " << (status.running ? "yes" : "no")
         << "\n"
-        << " Z: '" << m_runner->get_reg_stack_str(mk61emu_reg_stack_t::RZ) << "'\n"
-        << " Y: '" << m_runner->get_reg_stack_str(mk61emu_reg_stack_t::RY) << "'\n"
-        << " X: '" << m_runner->get_reg_stack_str(mk61emu_reg_stack_t::RX) << "'\n"
-        << "X1: '" << m_runner->get_reg_stack_str(mk61emu_reg_stack_t::RX1) << "'\n"
+        << " Z: '" << status.reg_stack[static_cast<int>(mk61emu_reg_stack_t::RZ)]
+        << "'\tKey ticks: " << status.input_ticks << "\n"
+        << " Y: '" << status.reg_stack[static_cast<int>(mk61emu_reg_stack_t::RY)]
+        << "'\tReturns:";
+    for (int i = 0; i < MK61EMU_RETURNS_COUNT; i++)
+        std::cout << " " << status.returns[i];
+    std::cout << "\n"
+        << " X: '" << status.reg_stack[static_cast<int>(mk61emu_reg_stack_t::RX)] << "'\n"
+        << "X1: '" << status.reg_stack[static_cast<int>(mk61emu_reg_stack_t::RX1)] << "'\n"
         << "\n"
-        << "DISPLAY: '" << m_runner->get_reg_stack_str(mk61emu_reg_stack_t::RX) << "'"
+        << "DISPLAY: '" << status.reg_stack[static_cast<int>(mk61emu_reg_stack_t::RX)] << "'"
         << std::endl;
 }
 
-mk_parse_result mk61_commander::parse_input(const std::string& cmd)
+void mk61_commander::output_state_record()
+{
+    emu_status status;
+    m_runner->flush();
+    m_runner->get_status(status);
+    const char* stack_names[MK61EMU_REG_STACK_COUNT] = { "X1", "X", "Y", "Z", "T" };
+    const char* mem_names = "0123456789ABCDE";
+    std::cout << "{\"power\": " << (status.power_state == engine_power_state_t::engine_on ? "\"ON\"" : "\"OFF\"")
+        << ", \"angle\": \"" << angle_unit_name(status.angle_unit) << "\""
+        << ", \"running\": " << (status.running ? "true" : "false")
+        << ", \"counter\": " << json_string(status.prog_counter)
+        << ", \"key_ticks\": " << status.input_ticks
+        << ", \"returns\": [";
+    for (int i = 0; i < MK61EMU_RETURNS_COUNT; i++)
+        std::cout << (i ? ", " : "") << json_string(status.returns[i]);
+    std::cout << "]";
+    for (int i = 0; i < MK61EMU_REG_STACK_COUNT; i++)
+        std::cout << ", \"" << stack_names[i] << "\": " << json_string(status.reg_stack[i]);
+    for (int i = 0; i < MK61EMU_REG_MEM_COUNT; i++)
+        std::cout << ", \"R" << mem_names[i] << "\": " << json_string(status.reg_mem[i]);
+    std::cout << "}\n";
+}
+
+const char* mk61_commander::angle_unit_name(const angle_unit_t value)
+{
+    switch (value)
+    {
+    case angle_unit_t::radian:
+        return "RAD";
+    case angle_unit_t::grade:
+        return "GRD";
+    case angle_unit_t::degree:
+        return "DEG";
+    default:
+        return "?";
+    }
+}
+
+std::string mk61_commander::json_string(const std::string& value)
+{
+    // the display pads the registers with spaces
+    const size_t first = value.find_first_not_of(' ');
+    const size_t last = value.find_last_not_of(' ');
+    std::string result = "\"";
+    if (first != std::string::npos)
+        for (size_t i = first; i <= last; i++)
+        {
+            const char c = value[i];
+            if (c == '"' || c == '\\')
+                result += '\\';
+            if (static_cast<unsigned char>(c) < 0x20)
+                result += ' ';
+            else
+                result += c;
+        }
+    return result + "\"";
+}
+
+mk_parse_result mk61_commander::parse_input(std::string_view cmd)
 {
     mk_parse_result result;
     result.parsed = false;
@@ -718,43 +1241,54 @@ mk_parse_result mk61_commander::parse_input(const std::string& cmd)
     {
         result.parsed = true;
         result.cmd_kind = mk_cmd_kind_t::cmd_keys;
-        for (const auto& key : instr->keys())
-        {
-            m_runner->do_key_press(key.key1(), key.key2());
-        }
+        // the keys of the lines in a row go as one batch, a long one in parts
+        m_keys += instr->input();
+        if (m_keys.size() >= keys_batch)
+            submit_keys();
     }
     else
     {
-        std::string cmd_up = strutils::to_upper(cmd);
-        if (cmd_up == "RAD")
+        // the other commands come after the keys typed before them
+        submit_keys();
+        if (strutils::equal_nocase(cmd, "RAD"))
         {
             result.cmd_kind = mk_cmd_kind_t::cmd_mode;
             m_runner->set_angle_unit(angle_unit_t::radian);
         }
-        else if (cmd_up == "GRAD")
+        else if (strutils::equal_nocase(cmd, "GRAD"))
         {
             result.cmd_kind = mk_cmd_kind_t::cmd_mode;
             m_runner->set_angle_unit(angle_unit_t::grade);
         }
-        else if (cmd_up == "DEG")
+        else if (strutils::equal_nocase(cmd, "DEG"))
         {
             result.cmd_kind = mk_cmd_kind_t::cmd_mode;
             m_runner->set_angle_unit(angle_unit_t::degree);
         }
-        //else if (cmd_up == "SAVE")
+        //else if (strutils::equal_nocase(cmd, "SAVE"))
         //    result.cmd_kind = mk_cmd_kind_t::cmd_save;
-        //else if (cmd_up == "LOAD")
+        //else if (strutils::equal_nocase(cmd, "LOAD"))
             //result.cmd_kind = mk_cmd_kind_t::cmd_load;
-        else if (cmd_up == "QUIT" || cmd_up == "EXIT")
+        else if (strutils::equal_nocase(cmd, "QUIT") || strutils::equal_nocase(cmd, "EXIT"))
             result.cmd_kind = mk_cmd_kind_t::cmd_quit;
-        else if (cmd_up == "OFF")
+        else if (strutils::equal_nocase(cmd, "OFF"))
             result.cmd_kind = mk_cmd_kind_t::cmd_off;
-        else if (cmd_up == "ON")
+        else if (strutils::equal_nocase(cmd, "ON"))
             result.cmd_kind = mk_cmd_kind_t::cmd_on;
-        else if (cmd_up == "HELP")
+        else if (strutils::equal_nocase(cmd, "HELP"))
             result.cmd_kind = mk_cmd_kind_t::cmd_help;
-        else if (cmd_up == "STATE")
+        else if (strutils::equal_nocase(cmd, "STATE"))
             result.cmd_kind = mk_cmd_kind_t::cmd_output_state;
+        else if (strutils::equal_nocase(cmd, "PLOAD"))
+            result.cmd_kind = mk_cmd_kind_t::cmd_program_load;
+        else if (strutils::equal_nocase(cmd, "PSAVE"))
+            result.cmd_kind = mk_cmd_kind_t::cmd_program_save;
+        else if (strutils::equal_nocase(cmd, "BACK"))
+            result.cmd_kind = mk_cmd_kind_t::cmd_back;
+        else if (strutils::equal_nocase(cmd, "SEEK"))
+            result.cmd_kind = mk_cmd_kind_t::cmd_seek;
+        else if (strutils::equal_nocase(cmd, "WAIT"))
+            result.cmd_kind = mk_cmd_kind_t::cmd_wait;
         if (result.cmd_kind != mk_cmd_kind_t::cmd_unknown)
             result.parsed = true;
     }
@@ -4,12 +4,16 @@
 #include <memory>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
 #include <vector>
 #include <map>
 #include "mk61emu.h"
-
-using strings_t = std::vector<std::string>;
+#include "mk61opcode.h"
+#include "mk61queue.h"
 
 enum class mk_cmd_kind_t
 {
@@ -23,7 +27,12 @@ enum class mk_cmd_kind_t
     cmd_output_state,
     cmd_help,
     cmd_mode,
-    cmd_keys
+    cmd_keys,
+    cmd_program_load,
+    cmd_program_save,
+    cmd_back,
+    cmd_seek,
+    cmd_wait
 };
 
 enum class mk_message_t
@@ -39,33 +48,112 @@ struct mk_parse_result
     bool          parsed   = false;
 };
 
+/**
+ * Calculator state shown by the commander. The runner publishes it after every
+ * change, so it is read without the lock and without allocations.
+ */
+struct emu_status
+{
+    engine_power_state_t power_state;
+    angle_unit_t angle_unit;
+    bool running;
+    mk61_register_t reg_stack[MK61EMU_REG_STACK_COUNT];
+    mk61_register_t reg_mem[MK61EMU_REG_MEM_COUNT];
+    char prog_counter[3];
+    char returns[MK61EMU_RETURNS_COUNT][3]; // subroutine return stack, the next return first
+    char indicator[15];
+    uint32_t input_ticks; // chipset ticks the last keys took, 0 with the opcode engine
+};
+
+enum class emu_command_kind_t
+{
+    key_press,
+    input,
+    power_state,
+    angle_unit
+};
+
+/**
+ * Command queued to the emulator thread
+ */
+struct emu_command
+{
+    emu_command_kind_t kind;
+    uint8_t key1, key2;
+    std::string input; // key stream of mk_engine::do_input
+    engine_power_state_t power_state;
+    angle_unit_t angle_unit;
+};
+
+const uint64_t MK61_WAIT_STEPS = 100000; // steps WAIT makes at most by default
+
 class emu_runner
 {
 public:
-    emu_runner();
+    explicit emu_runner(mk61_engine_kind_t engine_kind = mk61_engine_kind_t::microcode);
     ~emu_runner();
     emu_runner(const emu_runner&) = delete;
     emu_runner& operator =(const emu_runner&) = delete;
 public:
     void start();
     void terminate();
+public:
+    // Commands posted from one thread: they return at once with a ticket to wait for.
+    // The other methods wait for the posted commands first
+    uint64_t post_key_press(const uint8_t key1, const uint8_t key2);
+    uint64_t post_input(const std::string& input);
+    uint64_t post_power_state(const engine_power_state_t value);
+    uint64_t post_angle_unit(const angle_unit_t value);
+    void wait(const uint64_t ticket);
+    void flush();
 public:
     mk_result_t do_key_press(const uint8_t key1, const uint8_t key2);
+    mk_result_t do_input(const std::string& input);
     angle_unit_t get_angle_unit();
     engine_power_state_t get_power_state();
     std::string get_prog_counter_str();
     std::string get_reg_mem_str(const mk61emu_reg_mem_t reg);
     std::string get_reg_stack_str(const mk61emu_reg_stack_t reg);
+    mk61_number get_reg_mem(const mk61emu_reg_mem_t reg);
+    mk61_number get_reg_stack(const mk61emu_reg_stack_t reg);
+    void get_program(mk61_program_t& image);
+    void set_program(const mk61_program_t& image);
     bool is_emu_running();
     void set_angle_unit(angle_unit_t value);
     void set_power_state(engine_power_state_t value);
+    void get_status(emu_status& status) const;
+    uint64_t get_step_count();
+    void step_back(const uint64_t count);
+    void go_to_step(const uint64_t step);
+    // Runs the calculator until the program stops and it waits for a key, false if it still runs after max_steps
+    bool wait_stopped(const uint64_t max_steps, uint64_t& steps);
+    void set_simulate_delay(const bool value) { m_simulate_delay = value; }
 private:
+    mk61_emu& history_emu();
+    uint64_t post(const emu_command& command);
+    void wake();
+    void execute_unsafe(const emu_command& command);
     void do_step_unsafe();
+    bool has_work_unsafe();
+    void publish_unsafe();
     void internal_run();
 private:
     std::unique_ptr<std::thread> m_emu_thread;
-    std::unique_ptr<mk61_emu> m_emu;
-    std::mutex m_lock;
+    std::unique_ptr<mk61_engine> m_emu;
+    mk61_emu* m_microcode_emu = nullptr; // m_emu if it keeps the history of the steps
+    std::mutex m_lock; // the calculator
+    mk61_spsc_queue<emu_command, 256> m_commands;
+    std::atomic<uint64_t> m_posted = 0;
+    std::atomic<uint64_t> m_completed = 0;
+    // The runner sleeps on m_wake, the commands are waited for on m_done
+    std::mutex m_wake_lock;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    bool m_wake_pending = false;       // a command may have given the calculator work
+    std::atomic_bool m_has_work = false;
+    // Seqlock of the status: odd while the status is written
+    std::atomic<uint32_t> m_status_sequence = 0;
+    emu_status m_status;
     std::atomic_bool m_sig_term = false;
     std::atomic_bool m_simulate_delay = true;
 };
@@ -90,16 +178,16 @@ private:
 class mk_instruction_keys
 {
 public:
-    mk_instruction_keys(mk_instruction instruction, std::vector<mk_key_coord> keys)
-        : m_instruction(instruction), m_keys(keys)
-    {}
+    mk_instruction_keys(mk_instruction instruction, std::vector<mk_key_coord> keys);
 public:
     const mk_instruction& instruction() const { return m_instruction; }
     const std::vector<mk_key_coord>& keys() const { return m_keys; }
+    const std::string& input() const { return m_input; } // the keys as a do_input stream
     std::string keys_to_string() const;
 private:
     mk_instruction m_instruction;
     std::vector<mk_key_coord> m_keys;
+    std::string m_input;
 };
 
 
@@ -109,12 +197,14 @@ class instruction_index
 {
 public:
     typedef std::vector<mk_instruction_keys_sptr> data_t;
-    typedef std::map<std::string, mk_instruction_keys_sptr> index_t;
+    typedef std::map<std::string, mk_instruction_keys_sptr, strutils::less_nocase> index_t;
 public:
     void init();
 public:
-    mk_instruction_keys_sptr find(const std::string& mnemonics) const;
+    mk_instruction_keys_sptr find(std::string_view mnemonics) const;
     static std::string make_key(const std::string& mnemonics);
+    // Throws if an instruction typed in the programming mode is stored with another code by an engine
+    void check_codes() const;
     const data_t& data() const {
         return m_data;
     }
@@ -134,31 +224,59 @@ private:
 };
 
 
+/**
+ * Tokens of a command line separated by blanks, viewed in place
+ */
+class mk_tokenizer
+{
+public:
+    explicit mk_tokenizer(std::string_view text)
+        : m_text(text), m_position(0)
+    {}
+public:
+    bool next(std::string_view& token);
+private:
+    std::string_view m_text;
+    size_t m_position;
+};
+
 class mk61_commander
 {
 public:
-    mk61_commander();
+    explicit mk61_commander(mk61_engine_kind_t engine_kind = mk61_engine_kind_t::microcode);
     mk61_commander(const mk61_commander&) = delete;
     mk61_commander& operator =(const mk61_commander&) = delete;
     mk61_commander(mk61_commander&&) = delete;
     mk61_commander& operator =(mk61_commander&&) = delete;
 public:
     void run();
+    // Headless: no screen control, a JSON object per line for STATE and the messages
+    void run_script(std::istream& script);
 private:
     std::unique_ptr<emu_runner> m_runner;
     instruction_index m_instructions;
+    mk61_engine_kind_t m_engine_kind;
+    std::string m_keys; // key stream of the instructions not posted yet
+    static const size_t keys_batch = 512;
+    bool m_script = false;
 private:
     void clear_screen();
     void output_display();
     void show_help();
     void show_short_help();
     void output_state();
+    void output_state_record();
+    static const char* angle_unit_name(const angle_unit_t value);
+    static std::string json_string(const std::string& value);
 private:
     void show_message(const mk_message_t message_type, const std::string message);
-    strings_t parse_cmdline(const std::string& cmdline);
-    mk_parse_result parse_input(const std::string& cmd);
+    bool execute_cmdline(const std::string& cmdline); // false on QUIT
+    mk_parse_result parse_input(std::string_view cmd);
+    void submit_keys();
     void load_state(const std::string& filename);
     void save_state(const std::string& filename);
+    void load_program(const std::string& filename);
+    void save_program(const std::string& filename);
 };
 
 #endif // MK61COMMANDER_H_INCLUDED
@@ -1,4 +1,9 @@
+#include <stdexcept>
+#include <cmath>
+#include <limits>
 #include "mk61emu.h"
+#include "mk61cache.h"
+#include "mk61history.h"
 
 std::istream& operator>>(std::istream& input, angle_unit_t& data)
 {
@@ -740,7 +745,7 @@ static uint8_t stack_addresses_replacements_61[3][5] =
     { 8, 9, 10, 11, 0 }
 };
 
-static uint8_t return_addresses[5] = {28, 22, 16, 10, 4};
+static uint8_t return_addresses[MK61EMU_RETURNS_COUNT] = {28, 22, 16, 10, 4};
 
 const uint8_t program_counter_address = 34;
 
@@ -760,12 +765,128 @@ static uint8_t stack_addresses_replacements_54[3][5] =
 };
 
 
+/**
+ * IK13_decoded_ROM
+ */
+static mtick_t J[] =
+{
+    0, 1, 2, 3, 4, 5,
+    3, 4, 5, 3, 4, 5,
+    3, 4, 5, 3, 4, 5,
+    3, 4, 5, 3, 4, 5,
+    6, 7, 8, 0, 1, 2,
+    3, 4, 5, 6, 7, 8,
+    0, 1, 2, 3, 4, 5
+};
+
+static inline io_t nibble_mask(microinstruction_t value, uint8_t bit)
+{
+    return (value >> bit & 1) ? 0xf : 0;
+}
+
+IK13_decoded_ROM::IK13_decoded_ROM(const IK13_ROM& rom)
+{
+    for (uint8_t i = 0; i < 68; i++)
+    {
+        const microinstruction_t value = rom.microinstructions[i];
+        IK13_microinstruction& mi = microinstructions[i];
+        mi.alpha_R = nibble_mask(value, 0);
+        mi.alpha_M = nibble_mask(value, 1);
+        mi.alpha_ST = nibble_mask(value, 2);
+        mi.alpha_NR = nibble_mask(value, 3);
+        mi.alpha_L = nibble_mask(value, 4) & 0xa;
+        mi.alpha_S = nibble_mask(value, 5);
+        mi.alpha_const = nibble_mask(value, 6) & 4;
+        mi.beta_const = (nibble_mask(value, 11) & 1) | (nibble_mask(value, 10) & 6);
+        mi.beta_S1 = nibble_mask(value, 9);
+        mi.beta_NS = nibble_mask(value, 8);
+        mi.beta_S = nibble_mask(value, 7);
+        mi.gamma_NT = value >> 14 & 1;
+        mi.gamma_NL = value >> 13 & 1;
+        mi.gamma_L = value >> 12 & 1;
+        mi.R_mode = value >> 15 & 7;
+        mi.R_prev1 = value >> 18 & 1;
+        mi.R_prev2 = value >> 19 & 1;
+        mi.M_write = value >> 20 & 1;
+        mi.L_write = value >> 21 & 1;
+        mi.S_mode = value >> 22 & 3;
+        mi.S1_mode = value >> 24 & 3;
+        mi.ST_mode = value >> 26 & 3;
+    }
+    for (uint16_t ak = 0; ak < 256; ak++)
+    {
+        const instruction_t value = rom.instructions[ak];
+        IK13_instruction_trace& trace = instructions[ak];
+        trace.MOD = value >> 24 & 0xff;
+        trace.key_scan = (value & 0xfc0000) == 0;
+        trace.jump = 0;
+        trace.jump_lo = 0;
+        trace.jump_hi = 0;
+        for (uint8_t i = 0; i < IK13_MTICK_COUNT; i++)
+        {
+            uint8_t k = i / 9;
+            uint8_t ASP;
+            if (k < 3)
+                ASP = value & 0xff;
+            else if (k == 3)
+                ASP = value >> 8 & 0xff;
+            else
+            {
+                ASP = value >> 16 & 0xff;
+                if (ASP > 0x1f)
+                {
+                    trace.jump = 1;
+                    trace.jump_lo = ASP & 0xf;
+                    trace.jump_hi = ASP >> 4;
+                    ASP = 0x5f;
+                }
+            }
+            io_t AMK = rom.microprograms[ASP * 9 + J[i]] & 0x3f;
+            for (uint8_t L = 0; L < 2; L++)
+            {
+                if (AMK > 59)
+                    trace.AMK[i][L] = (AMK - 60) * 2 + (L == 0 ? 1 : 0) + 60;
+                else
+                    trace.AMK[i][L] = AMK;
+            }
+        }
+    }
+}
+
+const IK13_decoded_ROM* IK13_decoded_ROM::get(const IK13_ROM* rom)
+{
+    static const IK13_decoded_ROM IK1302(ROM.IK1302);
+    static const IK13_decoded_ROM IK1303(ROM.IK1303);
+    static const IK13_decoded_ROM IK1306(ROM.IK1306);
+    if (rom == &ROM.IK1302)
+        return &IK1302;
+    if (rom == &ROM.IK1303)
+        return &IK1303;
+    if (rom == &ROM.IK1306)
+        return &IK1306;
+    throw std::logic_error("Unknown IK13 ROM");
+}
+
 /**
  * IK13
  */
-IK13::IK13()
+
+// Neighbour slots of the 42-nibble ring registers, computed without division
+static inline mtick_t ring_next(const mtick_t slot, const mtick_t distance)
 {
-    memset(&(ROM), 0, sizeof(ROM));
+    const mtick_t result = slot + distance;
+    return result >= IK13_MTICK_COUNT ? result - IK13_MTICK_COUNT : result;
+}
+
+static inline mtick_t ring_prev(const mtick_t slot, const mtick_t distance)
+{
+    return slot >= distance ? slot - distance : slot + IK13_MTICK_COUNT - distance;
+}
+
+void IK13::reset()
+{
+    ROM = NULL;
+    decoded = NULL;
     memset(M, 0, sizeof(M));
     memset(R, 0, sizeof(R));
     memset(ST, 0, sizeof(ST));
@@ -775,110 +896,55 @@ IK13::IK13()
     T = 0;
     P = 0;
     mtick = 0;
-    microinstruction = 0;
     input = 0;
     output = 0;
     AMK = 0;
-    ASP = 0;
     AK = 0;
     MOD = 0;
     key_x = 0;
     key_y = 0;
     comma = 0;
+    key_seen = 0;
 }
 
 void IK13::set_ROM(const IK13_ROM* value)
 {
     this->ROM = value;
+    this->decoded = IK13_decoded_ROM::get(value);
 }
 
-static mtick_t J[] =
-{
-    0, 1, 2, 3, 4, 5,
-    3, 4, 5, 3, 4, 5,
-    3, 4, 5, 3, 4, 5,
-    3, 4, 5, 3, 4, 5,
-    6, 7, 8, 0, 1, 2,
-    3, 4, 5, 6, 7, 8,
-    0, 1, 2, 3, 4, 5
-};
-
 void IK13::tick()
 {
     mtick_t signal_I = mtick >> 2;
     mtick_t signal_D = mtick / 12 | 0;
 //    mtick_t signal_E = (mtick >> 2) % 3;
     if (mtick == 0)
-    {
         AK = R[36] + 16 * R[39];
-        if ((ROM->instructions[AK] & 0xfc0000) == 0)
-            T = 0;
-    }
-    mtick_t  k = mtick / 36 | 0;
-    if (k < 3)
-        ASP = ROM->instructions[AK] & 0xff;
-    else if (k == 3)
-        ASP = ROM->instructions[AK] >> 8 & 0xff;
-    else if (k == 4)
+    const IK13_instruction_trace& trace = decoded->instructions[AK];
+    if (mtick == 0)
     {
-        ASP = ROM->instructions[AK] >> 16 & 0xff;
-        if (ASP > 0x1f)
-        {
-            if (mtick == 144)
-            {
-                R[37] = ASP & 0xf;
-                R[40] = ASP >> 4;
-            }
-            ASP = 0x5f;
-        }
+        if (trace.key_scan)
+            T = 0;
     }
-    MOD = ROM->instructions[AK] >> 24 & 0xff;
-    AMK = ROM->microprograms[ASP * 9 + J[mtick >> 2]];
-    AMK = AMK & 0x3f;
-    if (AMK > 59)
+    else if (mtick == 144 && trace.jump)
     {
-        AMK = (AMK - 60) * 2;
-        if (L == 0)
-            AMK++;
-        AMK += 60;
+        R[37] = trace.jump_lo;
+        R[40] = trace.jump_hi;
     }
-    microinstruction = ROM->microinstructions[AMK];
-    io_t alpha = 0, beta = 0, gamma = 0;
-    switch (microinstruction >> 24 & 3)
+    MOD = trace.MOD;
+    AMK = trace.AMK[signal_I][L != 0];
+    const IK13_microinstruction& mi = decoded->microinstructions[AMK];
+    if (mi.S1_mode >= 2)
     {
-    case 2:
-    case 3:
         if ((mtick / 12 | 0) != key_x - 1)
             if (key_y > 0)
                 S1 |= key_y;
-        break;
     }
-    if ((microinstruction & 1) > 0)
-        alpha |= R[signal_I];
-    if ((microinstruction & 2) > 0)
-        alpha |= M[signal_I];
-    if ((microinstruction & 4) > 0)
-        alpha |= ST[signal_I];
-    if ((microinstruction & 8) > 0)
-        alpha |= ~R[signal_I] & 0xf;
-    if ((microinstruction & 16) > 0)
-        if (L == 0)
-            alpha |= 0xa;
-    if ((microinstruction & 32) > 0)
-        alpha |= S;
-    if ((microinstruction & 64) > 0)
-        alpha |= 4;
-    if ((microinstruction >> 7 & 16) > 0)
-        beta |= 1;
-    if ((microinstruction >> 7 & 8) > 0)
-        beta |= 6;
-    if ((microinstruction >> 7 & 4) > 0)
-        beta |= S1;
-    if ((microinstruction >> 7 & 2) > 0)
-        beta |= ~S & 0xf;
-    if ((microinstruction >> 7 & 1) > 0)
-        beta |= S;
-    if ((ROM->instructions[AK] & 0xfc0000) > 0)
+    const io_t r = R[signal_I];
+    io_t alpha = (r & mi.alpha_R) | (M[signal_I] & mi.alpha_M) | (ST[signal_I] & mi.alpha_ST) |
+                 (~r & mi.alpha_NR) | (L == 0 ? mi.alpha_L : 0) | (S & mi.alpha_S) | mi.alpha_const;
+    io_t beta = (S1 & mi.beta_S1) | (~S & mi.beta_NS) | (S & mi.beta_S) | mi.beta_const;
+    if (!trace.key_scan)
     {
         if (key_y == 0)
             T = 0;
@@ -890,26 +956,22 @@ void IK13::tick()
             {
                 S1 = key_y;
                 T = 1;
+                key_seen = 1;
             }
         if (/*signal_D >= 0 &&*/ signal_D < 12)
             if (L > 0)
                 comma = signal_D;
     }
-    if ((microinstruction >> 12 & 4) > 0)
-        gamma = ~T & 1;
-    if ((microinstruction >> 12 & 2) > 0)
-        gamma |= ~L & 1;
-    if ((microinstruction >> 12 & 1) > 0)
-        gamma |= L & 1;
+    io_t gamma = (~T & mi.gamma_NT) | (~L & mi.gamma_NL) | (L & mi.gamma_L);
     io_t sum = alpha + beta + gamma;
     io_t sigma = sum & 0xf;
     P = sum >> 4;
     if (MOD == 0 || (mtick >> 2) >= 36)
     {
-        switch (microinstruction >> 15 & 7)
+        switch (mi.R_mode)
         {
         case 1:
-            R[signal_I] = R[(signal_I + 3) % 42];
+            R[signal_I] = R[ring_next(signal_I, 3)];
             break;
         case 2:
             R[signal_I] = sigma;
@@ -930,16 +992,16 @@ void IK13::tick()
             R[signal_I] = R[signal_I] | sigma;
             break;
         }
-        if ((microinstruction >> 18 & 1) > 0)
-            R[(signal_I + 41) % 42] = sigma;
-        if ((microinstruction >> 19 & 1) > 0)
-            R[(signal_I + 40) % 42] = sigma;
+        if (mi.R_prev1)
+            R[ring_prev(signal_I, 1)] = sigma;
+        if (mi.R_prev2)
+            R[ring_prev(signal_I, 2)] = sigma;
     }
-    if ((microinstruction >> 21 & 1) > 0)
+    if (mi.L_write)
         L = P & 1;
-    if ((microinstruction >> 20 & 1) > 0)
+    if (mi.M_write)
         M[signal_I] = S;
-    switch (microinstruction >> 22 & 3)
+    switch (mi.S_mode)
     {
     case 1:
         S = S1;
@@ -951,7 +1013,7 @@ void IK13::tick()
         S = S1 | sigma;
         break;
     }
-    switch (microinstruction >> 24 & 3)
+    switch (mi.S1_mode)
     {
     case 1:
         S1 = sigma;
@@ -963,28 +1025,33 @@ void IK13::tick()
         S1 = S1 | sigma;
         break;
     }
-    io_t x, y, z;
-    switch (microinstruction >> 26 & 3)
+    if (mi.ST_mode != 0)
     {
-    case 1:
-        ST[(signal_I + 2) % 42] = ST[(signal_I + 1) % 42];
-        ST[(signal_I + 1) % 42] = ST[signal_I];
-        ST[signal_I] = sigma;
-        break;
-    case 2:
-        x = ST[signal_I];
-        ST[signal_I] = ST[(signal_I + 1) % 42];
-        ST[(signal_I + 1) % 42] = ST[(signal_I + 2) % 42];
-        ST[(signal_I + 2) % 42] = x;
-        break;
-    case 3:
-        x = ST[signal_I];
-        y = ST[(signal_I + 1) % 42];
-        z = ST[(signal_I + 2) % 42];
-        ST[signal_I % 42] = sigma | y;
-        ST[(signal_I + 1) % 42] = x | z;
-        ST[(signal_I + 2) % 42] = y | x;
-        break;
+        const mtick_t signal_I1 = ring_next(signal_I, 1);
+        const mtick_t signal_I2 = ring_next(signal_I, 2);
+        io_t x, y, z;
+        switch (mi.ST_mode)
+        {
+        case 1:
+            ST[signal_I2] = ST[signal_I1];
+            ST[signal_I1] = ST[signal_I];
+            ST[signal_I] = sigma;
+            break;
+        case 2:
+            x = ST[signal_I];
+            ST[signal_I] = ST[signal_I1];
+            ST[signal_I1] = ST[signal_I2];
+            ST[signal_I2] = x;
+            break;
+        case 3:
+            x = ST[signal_I];
+            y = ST[signal_I1];
+            z = ST[signal_I2];
+            ST[signal_I] = sigma | y;
+            ST[signal_I1] = x | z;
+            ST[signal_I2] = y | x;
+            break;
+        }
     }
     output = M[signal_I] & 0xf;
     M[signal_I] = input;
@@ -993,62 +1060,68 @@ void IK13::tick()
         mtick = 0;
 }
 
-void IK13::read_state(std::istream& data)
-{
-    for (uint16_t i = 0; i < sizeof(M); i++)
-        data >> M[i];
-    for (uint16_t i = 0; i < sizeof(R); i++)
-        data >> R[i];
-    for (uint16_t i = 0; i < sizeof(ST); i++)
-        data >> ST[i];
-    data >> S;
-    data >> S1;
-    data >> L;
-    data >> T;
-    data >> P;
-    data >> mtick;
-    data >> microinstruction;
-    data >> key_x;
-    data >> key_y;
-    data >> comma;
-    data >> input;
-    data >> output;
-    data >> AMK;
-    data >> ASP;
-    data >> AK;
-    data >> MOD;
-}
-
-void IK13::qrite_state(std::ostream& data)
-{
-    for (uint16_t i = 0; i < sizeof(M); i++)
-        data << M[i];
-    for (uint16_t i = 0; i < sizeof(R); i++)
-        data << R[i];
-    for (uint16_t i = 0; i < sizeof(ST); i++)
-        data << ST[i];
-    data << S;
-    data << S1;
-    data << L;
-    data << T;
-    data << P;
-    data << mtick;
-    data << microinstruction;
-    data << key_x;
-    data << key_y;
-    data << comma;
-    data << input;
-    data << output;
-    data << AMK;
-    data << ASP;
-    data << AK;
-    data << MOD;
+static void pack_nibbles(uint8_t *packed, const io_t *nibbles, const size_t count)
+{
+    for (size_t i = 0; i < count; i += 2)
+        packed[i / 2] = static_cast<uint8_t>(nibbles[i] | nibbles[i + 1] << 4);
+}
+
+static void unpack_nibbles(io_t *nibbles, const uint8_t *packed, const size_t count)
+{
+    for (size_t i = 0; i < count; i += 2)
+    {
+        nibbles[i] = packed[i / 2] & 0xf;
+        nibbles[i + 1] = packed[i / 2] >> 4;
+    }
+}
+
+void IK13::read_state(const mk61_snapshot_IK13& data)
+{
+    unpack_nibbles(R, data.R, IK13_MTICK_COUNT);
+    unpack_nibbles(M, data.M, IK13_MTICK_COUNT);
+    unpack_nibbles(ST, data.ST, IK13_MTICK_COUNT);
+    S = data.S;
+    S1 = data.S1;
+    L = data.L;
+    T = data.T;
+    P = data.P;
+    mtick = data.mtick;
+    AMK = data.AMK;
+    AK = data.AK;
+    MOD = data.MOD;
+    input = data.input;
+    output = data.output;
+    key_x = data.key_x;
+    key_y = data.key_y;
+    comma = data.comma;
+    key_seen = 0;
+}
+
+void IK13::write_state(mk61_snapshot_IK13& data) const
+{
+    pack_nibbles(data.R, R, IK13_MTICK_COUNT);
+    pack_nibbles(data.M, M, IK13_MTICK_COUNT);
+    pack_nibbles(data.ST, ST, IK13_MTICK_COUNT);
+    data.S = S;
+    data.S1 = S1;
+    data.L = L;
+    data.T = T;
+    data.P = P;
+    data.mtick = mtick;
+    data.AMK = AMK;
+    data.AK = AK;
+    data.MOD = MOD;
+    data.input = input;
+    data.output = output;
+    data.key_x = key_x;
+    data.key_y = key_y;
+    data.comma = comma;
 }
 
 /**
  * IR2
  */
-IR2::IR2()
+void IR2::reset()
 {
     input = 0;
     output = 0;
@@ -1065,22 +1138,160 @@ void IR2::tick()
         mtick = 0;
 }
 
-void IR2::read_state(std::istream& data)
+void IR2::read_state(const mk61_snapshot_IR2& data)
 {
-    for (uint16_t i = 0; i < IR2_MTICK_COUNT; i++)
-        data >> M[i];
-    data >> input;
-    data >> output;
-    data >> mtick;
+    unpack_nibbles(M, data.M, IR2_MTICK_COUNT);
+    mtick = data.mtick;
+    input = data.input;
+    output = data.output;
 }
 
-void IR2::write_state(std::ostream& data)
+void IR2::write_state(mk61_snapshot_IR2& data) const
 {
-    for (uint16_t i = 0; i < IR2_MTICK_COUNT; i++)
-        data << M[i];
-    data << input;
-    data << output;
-    data << mtick;
+    pack_nibbles(data.M, M, IR2_MTICK_COUNT);
+    data.mtick = mtick;
+    data.input = input;
+    data.output = output;
+}
+
+/**
+ * mk61_engine
+ */
+void mk61_engine::clear_register_str(mk61_register_t &reg)
+{
+    int len = sizeof(mk61_register_t);
+    memset(reg, ' ', len - 1);
+    reg[len - 1] = 0;
+}
+
+mk61_register_position_t mk61_engine::display_symbol(io_t value)
+{
+    return display_symbols[value & 0xf];
+}
+
+void mk61_engine::format_number(mk61_register_t &reg, const mk61_number &value)
+{
+    clear_register_str(reg);
+    // Exponent
+    // 0123456789012
+    // -1.2345678-99
+    short exp_value = value.exponent;
+    int i = 0;
+    while (value.mantissa[7 - i] == 0)
+    {
+        if (exp_value == 7 - i || i == 7)
+            break;
+        i++;
+    }
+    const int digits_len = 8 - i;
+    mk61_register_t coef_value;  // including exponent digits
+    clear_register_str(coef_value);
+    coef_value[0] = value.negative ? '-' : ' ';
+    bool has_point = false;
+    int j = 0;
+    for (i = 0; i < digits_len; i++)
+    {
+        coef_value[j++] = display_symbols[value.mantissa[i]];
+        if ((i == 0 && (exp_value < 0 || exp_value > 7)) || (i == exp_value))
+        {
+            coef_value[j++] = ',';
+            has_point = true;
+        }
+    }
+    if (!has_point)
+        coef_value[i] = ',';
+    memcpy(reg, &coef_value, sizeof(mk61_register_t));
+    if (exp_value < 0 || exp_value > 7)
+    {
+        if (exp_value < 0)
+        {
+            reg[10] = '-';
+            exp_value = -exp_value;
+        }
+        reg[11] = display_symbols[exp_value / 10];
+        reg[12] = display_symbols[exp_value % 10];
+    }
+}
+
+double mk61_number::to_double() const
+{
+    double result = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        if (mantissa[i] > 9)
+            return std::numeric_limits<double>::quiet_NaN();
+        result = result * 10 + mantissa[i];
+    }
+    // divide rather than multiply by a negative power: 10^-n is inexact
+    if (exponent >= 7)
+        result *= std::pow(10.0, exponent - 7);
+    else
+        result /= std::pow(10.0, 7 - exponent);
+    return negative ? -result : result;
+}
+
+/**
+ * Rounds the value to 8 significant digits. Returns false on overflow.
+ */
+bool mk61_engine::to_number(const double value, mk61_number &result)
+{
+    memset(&result, 0, sizeof(result));
+    result.negative = value < 0;
+    const double a = std::fabs(value);
+    if (a == 0)
+        return true;
+    int exponent = static_cast<int>(std::floor(std::log10(a)));
+    long long mantissa = std::llround(a * std::pow(10.0, 7 - exponent));
+    if (mantissa >= 100000000)
+    {
+        mantissa = (mantissa + 5) / 10;
+        exponent++;
+    }
+    else if (mantissa < 10000000)
+    {
+        mantissa = std::llround(a * std::pow(10.0, 8 - exponent));
+        exponent--;
+    }
+    if (exponent > 99)
+        return false;
+    if (exponent < -99)
+    {
+        result.negative = false;
+        return true;
+    }
+    for (int i = 7; i >= 0; i--)
+    {
+        result.mantissa[i] = mantissa % 10;
+        mantissa /= 10;
+    }
+    result.exponent = exponent;
+    return true;
+}
+
+double mk61_engine::get_reg_stack_value(mk61emu_reg_stack_t reg)
+{
+    return get_reg_stack(reg).to_double();
+}
+
+double mk61_engine::get_reg_mem_value(mk61emu_reg_mem_t reg)
+{
+    return get_reg_mem(reg).to_double();
+}
+
+void mk61_engine::set_reg_stack_value(mk61emu_reg_stack_t reg, const double value)
+{
+    mk61_number number;
+    if (!std::isfinite(value) || !to_number(value, number))
+        throw std::logic_error("Value is out of the calculator range");
+    set_reg_stack(reg, number);
+}
+
+void mk61_engine::set_reg_mem_value(mk61emu_reg_mem_t reg, const double value)
+{
+    mk61_number number;
+    if (!std::isfinite(value) || !to_number(value, number))
+        throw std::logic_error("Value is out of the calculator range");
+    set_reg_mem(reg, number);
 }
 
 /**
@@ -1090,11 +1301,11 @@ void IR2::write_state(std::ostream& data)
 mk61_emu::mk61_emu()
 {
     this->m_mode = mk61emu_mode_t::mode_61;
-    this->m_IR2_1 = NULL;
-    this->m_IR2_2 = NULL;
-    this->m_IK1302 = NULL;
-    this->m_IK1303 = NULL;
-    this->m_IK1306 = NULL;
+    memset(&m_chips, 0, sizeof(m_chips));
+    m_step_ticks = 0;
+    m_step_count = 0;
+    m_input_ticks = 0;
+    reset_idle();
     m_RSModeChanged = false;
     clear_registers();
     mk_engine::set_power_state(engine_power_state_t::engine_off);
@@ -1105,6 +1316,17 @@ mk61_emu::~mk61_emu()
     set_power_state(engine_power_state_t::engine_off);
 }
 
+std::unique_ptr<mk61_emu> mk61_emu::fork() const
+{
+    // Every tick writes the memories of all the chips, so sharing them until the
+    // first write saves nothing: the child copies the state block at once. The ROMs
+    // and the step cache are shared, the idle detection holds for the same state
+    std::unique_ptr<mk61_emu> child(new mk61_emu(*this));
+    child->m_step_history.reset();
+    child->m_step_count = 0;
+    return child;
+}
+
 void mk61_emu::clear_registers()
 {
     int i = 0;
@@ -1112,52 +1334,25 @@ void mk61_emu::clear_registers()
         clear_register_str(m_reg_stack[i]);
     for (i = 0; i < MK61EMU_REG_MEM_COUNT; i++)
         clear_register_str(m_reg_mem[i]);
+    // no digit of the memory is 0xff, so the first read marks every register as changed
+    memset(m_reg_stack_digits, 0xff, sizeof(m_reg_stack_digits));
+    memset(m_reg_mem_digits, 0xff, sizeof(m_reg_mem_digits));
+    m_reg_dirty = 0;
+    m_prog_counter[0] = m_prog_counter[1] = ' ';
 }
 
 bool mk61_emu::is_running()
 {
     if (get_power_state() == engine_power_state_t::engine_on)
     {
-        if (m_IK1302->comma == 11)
+        if (m_chips.IK1302.comma == 11)
             return true;
     }
     return false;
 }
 
-void mk61_emu::clear_register_str(mk61_register_t &reg)
-{
-    int len = sizeof(mk61_register_t);
-    memset(reg, ' ', len - 1);
-    reg[len - 1] = 0;
-}
-
 void mk61_emu::cleanup()
 {
-    if (m_IR2_1 != NULL)
-    {
-        delete m_IR2_1;
-        m_IR2_1 = NULL;
-    }
-    if (m_IR2_2 != NULL)
-    {
-        delete m_IR2_2;
-        m_IR2_2 = NULL;
-    }
-    if (m_IK1302 != NULL)
-    {
-        delete m_IK1302;
-        m_IK1302 = NULL;
-    }
-    if (m_IK1303 != NULL)
-    {
-        delete m_IK1303;
-        m_IK1303 = NULL;
-    }
-    if (m_IK1306 != NULL)
-    {
-        delete m_IK1306;
-        m_IK1306 = NULL;
-    }
     clear_registers();
 }
 
@@ -1171,20 +1366,24 @@ mk_result_t mk61_emu::set_power_state(const engine_power_state_t value)
     case engine_power_state_t::engine_on:
         cleanup();
         m_angle_unit = angle_unit_t::radian;
-        m_IR2_1 = new IR2();
-        m_IR2_2 = new IR2();
-        m_IK1302 = new IK13();
-        m_IK1303 = new IK13();
+        m_step_ticks = 0;
+        reset_idle();
+        m_chips.IR2_1.reset();
+        m_chips.IR2_2.reset();
+        m_chips.IK1302.reset();
+        m_chips.IK1303.reset();
+        m_chips.IK1306.reset();
+        // attach ROMs
+        m_chips.IK1302.set_ROM(&ROM.IK1302);
+        m_chips.IK1303.set_ROM(&ROM.IK1303);
         if (m_mode == mk61emu_mode_t::mode_61)
-            m_IK1306 = new IK13();
-        else
-            m_IK1306 = NULL;
-        // copy ROMs
-        m_IK1302->set_ROM(&ROM.IK1302);
-        m_IK1303->set_ROM(&ROM.IK1303);
-        if (m_IK1306 != NULL)
-            m_IK1306->set_ROM(&ROM.IK1306);
+            m_chips.IK1306.set_ROM(&ROM.IK1306);
         do_step();
+        // the history starts anew with the calculator
+        m_step_count = 0;
+        if (m_step_history)
+            m_step_history->clear();
+        checkpoint();
         break;
     case engine_power_state_t::engine_off:
         cleanup();
@@ -1198,11 +1397,11 @@ mk_result_t mk61_emu::do_key_press(const uint8_t key1, const uint8_t key2)
 {
     if (get_power_state() == engine_power_state_t::engine_on)
     {
-        if (m_IK1302 != NULL)
-        {
-            m_IK1302->key_x = key1;
-            m_IK1302->key_y = key2;
-        }
+        reset_idle();
+        m_chips.IK1302.key_x = key1;
+        m_chips.IK1302.key_y = key2;
+        m_chips.IK1302.key_seen = 0;
+        checkpoint();
         do_step();
         m_is_output_required = true;
     }
@@ -1220,244 +1419,640 @@ bool mk61_emu::is_output_required()
 }
 
 
-void mk61_emu::tick()
+/**
+ * Chipset layout by calculator mode
+ */
+template <mk61emu_mode_t mode> struct mk61_chipset;
+
+template <> struct mk61_chipset<mk61emu_mode_t::mode_61>
 {
-    m_IK1302->input = m_IR2_2->output;
-    m_IK1302->tick();
-    m_IK1303->input = m_IK1302->output;
-    m_IK1303->tick();
-    if (m_mode == mk61emu_mode_t::mode_61)
+    static const bool has_IK1306 = true;
+    static const uint8_t reg_mem_count = 15;
+    static const uint8_t program_size = 105;
+    static uint8_t page(const uint8_t replacement, const uint8_t i)
+    {
+        return pages_addresses_replacements_61[replacement][i];
+    }
+    static uint8_t stack(const uint8_t replacement, const uint8_t i)
+    {
+        return stack_addresses_replacements_61[replacement][i];
+    }
+};
+
+template <> struct mk61_chipset<mk61emu_mode_t::mode_54>
+{
+    static const bool has_IK1306 = false;
+    static const uint8_t reg_mem_count = 14;
+    static const uint8_t program_size = 98;
+    static uint8_t page(const uint8_t replacement, const uint8_t i)
+    {
+        return pages_addresses_replacements_54[replacement][i];
+    }
+    static uint8_t stack(const uint8_t replacement, const uint8_t i)
     {
-        m_IK1306->input = m_IK1303->output;
-        m_IK1306->tick();
-        m_IR2_1->input = m_IK1306->output;
+        return stack_addresses_replacements_54[replacement][i];
+    }
+};
+
+template <mk61emu_mode_t mode>
+void mk61_chipset_state::tick()
+{
+    IK1302.input = IR2_2.output;
+    IK1302.tick();
+    IK1303.input = IK1302.output;
+    IK1303.tick();
+    if constexpr (mk61_chipset<mode>::has_IK1306)
+    {
+        IK1306.input = IK1303.output;
+        IK1306.tick();
+        IR2_1.input = IK1306.output;
     }
     else
-        m_IR2_1->input = m_IK1303->output;
-    m_IR2_1->tick();
-    m_IR2_2->input = m_IR2_1->output;
-    m_IR2_2->tick();
-    m_IK1302->M[((m_IK1302->mtick >> 2) + 41) % 42] = m_IR2_2->output;
+        IR2_1.input = IK1303.output;
+    IR2_1.tick();
+    IR2_2.input = IR2_1.output;
+    IR2_2.tick();
+    IK1302.M[ring_prev(IK1302.mtick >> 2, 1)] = IR2_2.output;
 }
 
-void mk61_emu::read_number(mk61_register_t &reg, uint8_t chip, unsigned char address)
+template void mk61_chipset_state::tick<mk61emu_mode_t::mode_61>();
+template void mk61_chipset_state::tick<mk61emu_mode_t::mode_54>();
+
+uint64_t mk61_chipset_state::hash() const
+{
+    static_assert(sizeof(mk61_chipset_state) % sizeof(uint64_t) == 0, "Chipset state must consist of whole words");
+    const unsigned char *data = reinterpret_cast<const unsigned char*>(this);
+    uint64_t result = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < sizeof(mk61_chipset_state); i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        result = (result ^ word) * 0x100000001b3ULL;
+        result ^= result >> 29;
+    }
+    return result;
+}
+
+io_t* mk61_emu::chip_memory(uint8_t chip)
 {
-    clear_register_str(reg);
-    io_t *m;
     switch (chip)
     {
     case 1:
-        m = m_IR2_1->M;
-        break;
+        return m_chips.IR2_1.M;
     case 2:
-        m = m_IR2_2->M;
-        break;
+        return m_chips.IR2_2.M;
     case 3:
-        m = m_IK1302->M;
-        break;
+        return m_chips.IK1302.M;
     case 4:
-        m = m_IK1303->M;
-        break;
+        return m_chips.IK1303.M;
     default:
-        m = m_IK1306->M;
-        break;  /*case 5*/
-    }
-    // Exponent
-    // 0123456789012
-    // -1.2345678-99
-    short exp_value = m[address - 3] * 10 + m[address - 6];
-    if (m[address] == 9)
-        exp_value = -(100 - exp_value);
-    int i = 0;
-    while (m[address - 33 + i * 3] == 0)
-    {
-        if (exp_value == 7 - i || i == 7)
-            break;
-        i++;
+        return m_chips.IK1306.M;  /*case 5*/
     }
+}
 
-    unsigned char digits[8];
-    memset(digits, 0, 8);
-    int digits_len = 0;
-    int j = 8 - i;
-    while (i < 8)
+bool mk61_emu::read_digits(mk61_register_digits_t &digits, uint8_t chip, unsigned char address)
+{
+    const io_t *m = chip_memory(chip);
+    bool changed = false;
+    for (int i = 0; i < MK61EMU_REG_DIGITS; i++)
     {
-        digits[--j] = m[address - 33 + i * 3];
-        digits_len++;
-        i++;
+        const io_t digit = m[address - 33 + i * 3];
+        changed |= digits[i] != digit;
+        digits[i] = digit;
     }
-    mk61_register_t coef_value;  // including exponent digits
-    clear_register_str(coef_value);
-    coef_value[0] = (m[address - 9] == 9) ? '-' : ' ';
-    bool has_point = false;
-    j = 0;
-    for (i = 0; i < digits_len; i++)
+    return changed;
+}
+
+void mk61_emu::write_digits(const mk61_register_digits_t &digits, uint8_t chip, unsigned char address)
+{
+    io_t *m = chip_memory(chip);
+    for (int i = 0; i < MK61EMU_REG_DIGITS; i++)
+        m[address - 33 + i * 3] = digits[i];
+}
+
+template <mk61emu_mode_t mode>
+void mk61_emu::write_register(const mk61_register_digits_t &digits, const bool stack, const uint8_t index)
+{
+    typedef mk61_chipset<mode> chipset;
+    // The step ends when IR2_1.mtick is 84, 168 or 0, every phase shifts the registers differently
+    const uint8_t replacement = (m_chips.IR2_1.mtick / 84 + 2) % 3;
+    if (stack)
+        write_digits(digits,
+                     stack_addresses[chipset::stack(replacement, index)][0],
+                     stack_addresses[chipset::stack(replacement, index)][1]);
+    else
+        write_digits(digits,
+                     pages_addresses[chipset::page(replacement, index)][0],
+                     pages_addresses[chipset::page(replacement, index)][1] - 8);
+}
+
+void mk61_emu::write_register(const mk61_number &value, const bool stack, const uint8_t index)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        throw std::logic_error("Calculator is off");
+    if (m_step_ticks != 0)
+        throw std::logic_error("Registers can be written between steps only");
+    if (!stack && m_mode == mk61emu_mode_t::mode_54 && index >= mk61_chipset<mk61emu_mode_t::mode_54>::reg_mem_count)
+        throw std::logic_error("No such register in MK54 mode");
+    for (int i = 0; i < 8; i++)
+        if (value.mantissa[i] > 9)
+            throw std::logic_error("Mantissa digit is out of range");
+    if (value.exponent < -99 || value.exponent > 99)
+        throw std::logic_error("Exponent is out of range");
+    mk61_register_digits_t digits;
+    encode_number(digits, value);
+    if (m_mode == mk61emu_mode_t::mode_61)
+        write_register<mk61emu_mode_t::mode_61>(digits, stack, index);
+    else
+        write_register<mk61emu_mode_t::mode_54>(digits, stack, index);
+    // the registers may be read from the memory in another phase only, so update them here
+    mk61_register_digits_t &latched = stack ? m_reg_stack_digits[index] : m_reg_mem_digits[index];
+    if (memcmp(latched, digits, sizeof(digits)) != 0)
     {
-        coef_value[j++] = display_symbols[digits[i]];
-        if ((i == 0 && (exp_value < 0 || exp_value > 7)) || (i == exp_value))
-        {
-            coef_value[j++] = ',';
-            has_point = true;
-        }
+        memcpy(latched, digits, sizeof(digits));
+        m_reg_dirty |= 1u << (stack ? MK61EMU_REG_MEM_COUNT + index : index);
+        m_is_output_required = true;
     }
-    if (!has_point)
-        coef_value[i] = ',';
-    memcpy(reg, &coef_value, sizeof(mk61_register_t));
-    if (exp_value < 0 || exp_value > 7)
+    reset_idle();
+    checkpoint();
+}
+
+template <mk61emu_mode_t mode>
+io_t* mk61_emu::program_cell(const uint8_t step)
+{
+    typedef mk61_chipset<mode> chipset;
+    // Every memory page keeps a register and 7 program steps, the steps of the i-th
+    // page go after the register Ri. A step takes 2 cells: the low digit, the high one
+    const uint8_t replacement = (m_chips.IR2_1.mtick / 84 + 2) % 3;
+    const uint8_t page = chipset::page(replacement, step / 7);
+    const uint8_t address = pages_addresses[page][1];
+    const uint8_t offset = step % 7;
+    return chip_memory(pages_addresses[page][0]) + (offset == 0 ? address - 3 : address - 45 + offset * 6);
+}
+
+void mk61_emu::decode_number(mk61_number &value, const mk61_register_digits_t &digits)
+{
+    if (digits[0] > 0xf)
     {
-        if (exp_value < 0)
-        {
-            reg[10] = '-';
-            exp_value = -exp_value;
-        }
-        reg[11] = display_symbols[exp_value / 10];
-        reg[12] = display_symbols[exp_value % 10];
+        // not read yet
+        memset(&value, 0, sizeof(value));
+        return;
     }
+    value.negative = digits[8] == 9;
+    for (int i = 0; i < 8; i++)
+        value.mantissa[7 - i] = digits[i];
+    value.exponent = digits[10] * 10 + digits[9];
+    if (digits[11] == 9)
+        value.exponent = -(100 - value.exponent);
+}
+
+void mk61_emu::encode_number(mk61_register_digits_t &digits, const mk61_number &value)
+{
+    for (int i = 0; i < 8; i++)
+        digits[i] = value.mantissa[7 - i];
+    digits[8] = value.negative ? 9 : 0;
+    const int16_t exponent = value.exponent < 0 ? 100 + value.exponent : value.exponent;
+    digits[9] = exponent % 10;
+    digits[10] = exponent / 10;
+    digits[11] = value.exponent < 0 ? 9 : 0;
 }
 
+template <mk61emu_mode_t mode>
 void mk61_emu::read_all_fields(uint8_t replacement)
 {
+    typedef mk61_chipset<mode> chipset;
     uint8_t i = 0;
-    for (i = 0; i < (m_mode == mk61emu_mode_t::mode_61 ? 15 : 14); i++)
-        if (m_mode == mk61emu_mode_t::mode_61)
-            read_number(m_reg_mem[i],
-                       pages_addresses[pages_addresses_replacements_61[replacement][i]][0],
-                       pages_addresses[pages_addresses_replacements_61[replacement][i]][1] - 8);
-        else
-            read_number(m_reg_mem[i],
-                       pages_addresses[pages_addresses_replacements_54[replacement][i]][0],
-                       pages_addresses[pages_addresses_replacements_54[replacement][i]][1] - 8);
-    for (i = 0; i < 5; i++)
-        if (m_mode == mk61emu_mode_t::mode_61)
-            read_number(m_reg_stack[i],
-                       stack_addresses[stack_addresses_replacements_61[replacement][i]][0],
-                       stack_addresses[stack_addresses_replacements_61[replacement][i]][1]);
-        else
-            read_number(m_reg_stack[i],
-                       stack_addresses[stack_addresses_replacements_54[replacement][i]][0],
-                       stack_addresses[stack_addresses_replacements_54[replacement][i]][1]);
-    m_prog_counter[0] = display_symbols[m_IK1302->R[program_counter_address]];
-    m_prog_counter[1] = display_symbols[m_IK1302->R[program_counter_address - 3]];
+    uint32_t changed = 0;
+    for (i = 0; i < chipset::reg_mem_count; i++)
+        if (read_digits(m_reg_mem_digits[i],
+                        pages_addresses[chipset::page(replacement, i)][0],
+                        pages_addresses[chipset::page(replacement, i)][1] - 8))
+            changed |= 1u << i;
     for (i = 0; i < 5; i++)
+        if (read_digits(m_reg_stack_digits[i],
+                        stack_addresses[chipset::stack(replacement, i)][0],
+                        stack_addresses[chipset::stack(replacement, i)][1]))
+            changed |= 1u << (MK61EMU_REG_MEM_COUNT + i);
+    const mk61_register_position_t prog_counter[2] =
+    {
+        display_symbols[m_chips.IK1302.R[program_counter_address]],
+        display_symbols[m_chips.IK1302.R[program_counter_address - 3]]
+    };
+    if (changed != 0 || prog_counter[0] != m_prog_counter[0] || prog_counter[1] != m_prog_counter[1])
+        m_is_output_required = true;
+    m_reg_dirty |= changed;
+    m_prog_counter[0] = prog_counter[0];
+    m_prog_counter[1] = prog_counter[1];
+    for (i = 0; i < MK61EMU_RETURNS_COUNT; i++)
     {
-        m_returns[i][0] = display_symbols[m_IK1302->R[return_addresses[i]]];
-        m_returns[i][1] = display_symbols[m_IK1302->R[return_addresses[i] - 3]];
+        m_returns[i][0] = display_symbols[m_chips.IK1302.R[return_addresses[i]]];
+        m_returns[i][1] = display_symbols[m_chips.IK1302.R[return_addresses[i] - 3]];
     }
 }
 
-mk_result_t mk61_emu::do_step()
+void mk61_emu::read_registers()
 {
-    bool wasRunning = is_running();
-    // Save registers state
-    mk61_register_t reg_mem[MK61EMU_REG_MEM_COUNT];
-    mk61_register_t reg_stack[MK61EMU_REG_STACK_COUNT];
-    mk61_register_position_t prog_counter[2];
-    int i, j = 0;
-    if (!m_is_output_required)
+    // between steps the registers are found in any phase of the memories
+    const uint8_t replacement = (m_chips.IR2_1.mtick / 84 + 2) % 3;
+    if (m_mode == mk61emu_mode_t::mode_61)
+        read_all_fields<mk61emu_mode_t::mode_61>(replacement);
+    else
+        read_all_fields<mk61emu_mode_t::mode_54>(replacement);
+}
+
+void mk61_emu::reset_idle()
+{
+    m_idle = false;
+    m_history_count = 0;
+    m_history_last = 0;
+}
+
+void mk61_emu::record_step()
+{
+    // Without input a step is a function of the chipset state, so when the state
+    // matches the one MK61EMU_IDLE_STEPS steps ago, the recorded steps repeat forever
+    const uint8_t next = (m_history_last + 1) % MK61EMU_IDLE_STEPS;
+    if (m_history_count == MK61EMU_IDLE_STEPS && memcmp(&m_history[next], &m_chips, sizeof(m_chips)) == 0)
+        m_idle = true;
+    memcpy(&m_history[next], &m_chips, sizeof(m_chips));
+    m_history_last = next;
+    if (m_history_count < MK61EMU_IDLE_STEPS)
+        m_history_count++;
+}
+
+void mk61_emu::set_step_cache(std::shared_ptr<mk61_step_cache> value)
+{
+    m_step_cache = value;
+}
+
+void mk61_emu::set_history(std::shared_ptr<mk61_history> value)
+{
+    m_step_history = value;
+    m_step_count = 0;
+    if (m_step_history)
     {
-        for (i = 0; i < (m_mode == mk61emu_mode_t::mode_61 ? 15 : 14); i++)
-            memcpy(reg_mem[0], m_reg_mem[0], sizeof(m_reg_mem));
-        for (i = 0; i < 5; i++)
-            memcpy(reg_stack[0], m_reg_stack[0], sizeof(m_reg_stack));
-        for (i = 0; i < 2; i++)
-            prog_counter[i] = m_prog_counter[i];
+        m_step_history->clear();
+        if (get_power_state() == engine_power_state_t::engine_on)
+            checkpoint();
     }
+}
+
+void mk61_emu::count_step()
+{
+    if (!m_step_history)
+        return;
+    m_step_count++;
+    // Steps made again after going back are in the history already,
+    // idle steps repeat the recorded ones
+    if (m_step_count > m_step_history->get_last() && !m_idle && m_step_count % m_step_history->get_interval() == 0)
+        checkpoint();
+}
+
+void mk61_emu::checkpoint()
+{
+    // Replaying from a snapshot repeats the calculator only up to the next input,
+    // so every input is followed by a snapshot. It replaces the recorded future
+    if (!m_step_history || get_power_state() == engine_power_state_t::engine_off)
+        return;
+    mk61_snapshot snapshot;
+    get_snapshot(snapshot);
+    m_step_history->record(m_step_count, snapshot);
+}
 
-    this->m_IK1303->key_y = 1;
-    this->m_IK1303->key_x = static_cast<int8_t>(m_angle_unit);
-//    FILE *f = fopen("trace_c.txt", "w");
-    for (int count = 1; count <= 560; count++)
+void mk61_emu::step_back(const uint64_t count)
+{
+    go_to_step(count < m_step_count ? m_step_count - count : 0);
+}
+
+void mk61_emu::go_to_step(const uint64_t step)
+{
+    if (!m_step_history)
+        throw std::logic_error("No history of the steps");
+    if (get_power_state() == engine_power_state_t::engine_off)
+        throw std::logic_error("Calculator is off");
+    // the nearest snapshot, unless the calculator gets there sooner by itself
+    uint64_t found;
+    mk61_snapshot snapshot;
+    if (!m_step_history->find(step, found, snapshot))
+        throw std::logic_error("Step is out of the history");
+    if (step < m_step_count || found > m_step_count)
     {
-        for (i = 0; i < 42; i++)
-        {
-            tick();
-//            if (count > 0 && count < 10)
-//                fprintf(f, "%3d  %2d: %10d  %10d  %10d  %10d  %10d | %3d  %3d  %3d  %3d  %3d\n",
-//                        count, i,
-//                        this->IR2_1->output,
-//                        this->IR2_2->output,
-//                        this->IK1302->output,
-//                        this->IK1303->output,
-//                        this->IK1306->output,
-//                        this->IR2_1->mtick,
-//                        this->IR2_2->mtick,
-//                        this->IK1302->mtick,
-//                        this->IK1303->mtick,
-//                        this->IK1306->mtick);
-        }
+        load_snapshot(snapshot);
+        m_step_count = found;
+    }
+    while (m_step_count < step)
+    {
+        // idle steps repeat, only their count modulo the period matters
+        if (m_idle)
+            m_step_count = step - (step - m_step_count) % MK61EMU_IDLE_STEPS;
+        if (m_step_count < step)
+            do_step();
     }
-//	fclose(f);
-    this->m_IK1302->key_x = 0;
-    this->m_IK1302->key_y = 0;
+    if (m_step_ticks == 0)
+        read_registers();
+    m_is_output_required = true;
+}
 
-    if (this->m_IR2_1->mtick == 84)
-        read_all_fields(0);
+bool mk61_emu::is_idle()
+{
+    return get_power_state() == engine_power_state_t::engine_on && m_idle;
+}
 
-    if (!m_is_output_required)
+template <mk61emu_mode_t mode>
+uint32_t mk61_emu::advance(const mk61_step_until_t until, uint32_t count, const uint32_t max_ticks)
+{
+    uint32_t ticks = 0;
+    io_t prog_counter[2] = { m_chips.IK1302.R[program_counter_address], m_chips.IK1302.R[program_counter_address - 3] };
+    mk61_chipset_state fingerprint, step_start;
+    uint64_t step_hash = 0;
+    bool caching = false;
+    if (until == mk61_step_until_t::settled)
+        memcpy(&fingerprint, &m_chips, sizeof(m_chips));
+    while (count > 0 && ticks + IK13_MTICK_COUNT <= max_ticks)
     {
-        for (i = 0; i < (m_mode == mk61emu_mode_t::mode_61 ? 15 : 14); i++)
+        if (until == mk61_step_until_t::step && m_step_ticks == 0 && ticks + MK61EMU_STEP_TICKS <= max_ticks)
         {
-            for (j = 0; j < mk61_register_positions_count; j++)
+            if (m_idle)
+            {
+                // the steps repeat, no need to emulate them
+                m_history_last = (m_history_last + 1) % MK61EMU_IDLE_STEPS;
+                memcpy(&m_chips, &m_history[m_history_last], sizeof(m_chips));
+                ticks += MK61EMU_STEP_TICKS;
+                count--;
+                count_step();
+                continue;
+            }
+            if (m_step_cache)
             {
-                if (reg_mem[i][j] != m_reg_mem[i][j])
+                step_hash = m_chips.hash();
+                if (m_step_cache->find(step_hash, m_chips))
                 {
-                    m_is_output_required = true;
-                    break;
+                    ticks += MK61EMU_STEP_TICKS;
+                    count--;
+                    if (m_chips.IR2_1.mtick == 84)
+                        read_all_fields<mode>(0);
+                    record_step();
+                    count_step();
+                    continue;
                 }
+                memcpy(&step_start, &m_chips, sizeof(m_chips));
+                caching = true;
             }
-            if (m_is_output_required)
-                break;
         }
-    }
-    if (!m_is_output_required)
-    {
-        for (i = 0; i < 5; i++)
+        for (int i = 0; i < IK13_MTICK_COUNT; i++)
+            m_chips.tick<mode>();
+        ticks += IK13_MTICK_COUNT;
+        m_step_ticks += IK13_MTICK_COUNT;
+        if (m_step_ticks == MK61EMU_STEP_TICKS)
         {
-            for (j = 0; j < mk61_register_positions_count; j++)
+            // the key is held for the rest of do_step
+            m_step_ticks = 0;
+            m_chips.IK1302.key_x = 0;
+            m_chips.IK1302.key_y = 0;
+            if (caching)
             {
-                if (reg_stack[i][j] != m_reg_stack[i][j])
-                {
-                    m_is_output_required = true;
-                    break;
-                }
+                m_step_cache->insert(step_hash, step_start, m_chips);
+                caching = false;
             }
-            if (m_is_output_required)
-                break;
+            if (m_chips.IR2_1.mtick == 84)
+                read_all_fields<mode>(0);
+            record_step();
+            count_step();
+            if (until == mk61_step_until_t::step)
+                count--;
         }
-    }
-    if (!m_is_output_required)
-    {
-        for (i = 0; i < 2; i++)
-            if (prog_counter[i] != m_prog_counter[i])
+        switch (until)
+        {
+        case mk61_step_until_t::cycle:
+            count--;
+            break;
+        case mk61_step_until_t::instruction:
+            if (m_chips.IK1302.R[program_counter_address] != prog_counter[0] ||
+                m_chips.IK1302.R[program_counter_address - 3] != prog_counter[1])
+            {
+                prog_counter[0] = m_chips.IK1302.R[program_counter_address];
+                prog_counter[1] = m_chips.IK1302.R[program_counter_address - 3];
+                count--;
+            }
+            break;
+        case mk61_step_until_t::settled:
+            // the chipset is deterministic: once its state repeats, it repeats forever
+            if (ticks % MK61EMU_SETTLE_TICKS == 0)
             {
-                m_is_output_required = true;
-                break;
+                if (memcmp(&fingerprint, &m_chips, sizeof(m_chips)) == 0)
+                    count--;
+                else
+                    memcpy(&fingerprint, &m_chips, sizeof(m_chips));
             }
+            break;
+        default:
+            break;
+        }
     }
-    m_RSModeChanged = wasRunning != is_running();
+    return ticks;
+}
+
+mk_result_t mk61_emu::do_step()
+{
+    do_step_until(mk61_step_until_t::step, 1, MK61EMU_STEP_TICKS);
     return mk_result_t::mk_ok;
 }
 
-mk_result_t mk61_emu::do_input(const char*, size_t)
+uint32_t mk61_emu::do_step_until(const mk61_step_until_t until, const uint32_t count, const uint32_t max_ticks)
 {
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return 0;
+    bool wasRunning = is_running();
+    m_chips.IK1303.key_y = 1;
+    m_chips.IK1303.key_x = static_cast<int8_t>(m_angle_unit);
+    uint32_t ticks;
+    if (m_mode == mk61emu_mode_t::mode_61)
+        ticks = advance<mk61emu_mode_t::mode_61>(until, count, max_ticks);
+    else
+        ticks = advance<mk61emu_mode_t::mode_54>(until, count, max_ticks);
+    m_RSModeChanged = wasRunning != is_running();
+    return ticks;
+}
+
+mk_result_t mk61_emu::do_input(const char* buf, size_t length)
+{
+    if (!mk61_input_key::is_valid(buf, length))
+        return mk_result_t::mk_error;
+    m_input_ticks = 0;
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return mk_result_t::mk_ok;
+    const char* end = buf + length;
+    mk61_input_key key;
+    while (mk61_input_key::read(buf, end, key))
+        m_input_ticks += input_key(key);
+    m_is_output_required = true;
     return mk_result_t::mk_ok;
 }
 
+uint32_t mk61_emu::input_key(const mk61_input_key& key)
+{
+    // A busy calculator scans the keyboard rarely: the key is held until found.
+    // It is done once the calculator waits for the next one or runs the program
+    uint32_t ticks = 0;
+    uint8_t steps = 0;
+    reset_idle();
+    m_chips.IK1302.key_seen = 0;
+    do
+    {
+        // do_step releases the key at its end
+        m_chips.IK1302.key_x = key.key1;
+        m_chips.IK1302.key_y = key.key2;
+        checkpoint();
+        ticks += do_step_until(mk61_step_until_t::step, 1, MK61EMU_STEP_TICKS);
+        steps++;
+    } while (steps < MK61EMU_INPUT_STEPS && (steps < key.hold || !m_chips.IK1302.key_seen));
+    for (steps = 0; steps < MK61EMU_INPUT_STEPS && !m_idle && !is_running(); steps++)
+        ticks += do_step_until(mk61_step_until_t::step, 1, MK61EMU_STEP_TICKS);
+    return ticks;
+}
+
+/*
+* mk61_input_key
+*/
+bool mk61_input_key::read(const char*& buf, const char* end, mk61_input_key& key)
+{
+    if (end - buf < 2)
+        return false;
+    const uint8_t key1 = static_cast<uint8_t>(buf[0]);
+    const bool has_hold = (key1 & MK61_INPUT_HOLD) != 0;
+    if (has_hold && end - buf < 3)
+        return false;
+    key.key1 = key1 & ~MK61_INPUT_HOLD;
+    key.key2 = static_cast<uint8_t>(buf[1]);
+    key.hold = has_hold ? static_cast<uint8_t>(buf[2]) : 1;
+    buf += has_hold ? 3 : 2;
+    return true;
+}
+
+void mk61_input_key::write(std::string& stream, const uint8_t key1, const uint8_t key2, const uint8_t hold)
+{
+    if (hold == 1)
+    {
+        stream.push_back(static_cast<char>(key1));
+        stream.push_back(static_cast<char>(key2));
+        return;
+    }
+    stream.push_back(static_cast<char>(key1 | MK61_INPUT_HOLD));
+    stream.push_back(static_cast<char>(key2));
+    stream.push_back(static_cast<char>(hold));
+}
+
+bool mk61_input_key::is_valid(const char* buf, size_t length)
+{
+    const char* end = buf + length;
+    mk61_input_key key;
+    while (read(buf, end, key))
+        if (key.hold == 0)
+            return false;
+    return buf == end;
+}
+
 
 const char* mk61_emu::get_reg_stack_str(mk61emu_reg_stack_t reg)
 {
     if (get_power_state() == engine_power_state_t::engine_off)
         return "";
-    return this->m_reg_stack[static_cast<int>(reg)];
+    const uint32_t bit = 1u << (MK61EMU_REG_MEM_COUNT + static_cast<int>(reg));
+    if (m_reg_dirty & bit)
+    {
+        format_number(m_reg_stack[static_cast<int>(reg)], get_reg_stack(reg));
+        m_reg_dirty &= ~bit;
+    }
+    return m_reg_stack[static_cast<int>(reg)];
 }
 
 const char* mk61_emu::get_reg_mem_str(mk61emu_reg_mem_t reg)
 {
     if (get_power_state() == engine_power_state_t::engine_off)
         return "";
+    const uint32_t bit = 1u << static_cast<int>(reg);
+    if (m_reg_dirty & bit)
+    {
+        format_number(m_reg_mem[static_cast<int>(reg)], get_reg_mem(reg));
+        m_reg_dirty &= ~bit;
+    }
     return m_reg_mem[static_cast<int>(reg)];
 }
 
+mk61_number mk61_emu::get_reg_stack(mk61emu_reg_stack_t reg)
+{
+    mk61_number value;
+    if (get_power_state() == engine_power_state_t::engine_off)
+        memset(&value, 0, sizeof(value));
+    else
+        decode_number(value, m_reg_stack_digits[static_cast<int>(reg)]);
+    return value;
+}
+
+mk61_number mk61_emu::get_reg_mem(mk61emu_reg_mem_t reg)
+{
+    mk61_number value;
+    if (get_power_state() == engine_power_state_t::engine_off)
+        memset(&value, 0, sizeof(value));
+    else
+        decode_number(value, m_reg_mem_digits[static_cast<int>(reg)]);
+    return value;
+}
+
+void mk61_emu::set_reg_stack(mk61emu_reg_stack_t reg, const mk61_number &value)
+{
+    write_register(value, true, static_cast<uint8_t>(reg));
+}
+
+void mk61_emu::set_reg_mem(mk61emu_reg_mem_t reg, const mk61_number &value)
+{
+    write_register(value, false, static_cast<uint8_t>(reg));
+}
+
+void mk61_emu::get_program(mk61_program_t &image)
+{
+    memset(image, 0, sizeof(image));
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return;
+    if (m_step_ticks != 0)
+        throw std::logic_error("Program can be read between steps only");
+    for (uint8_t i = 0; i < MK61_PROGRAM_SIZE; i++)
+    {
+        io_t *cell;
+        if (m_mode == mk61emu_mode_t::mode_61)
+            cell = program_cell<mk61emu_mode_t::mode_61>(i);
+        else if (i < mk61_chipset<mk61emu_mode_t::mode_54>::program_size)
+            cell = program_cell<mk61emu_mode_t::mode_54>(i);
+        else
+            break;
+        image[i] = static_cast<uint8_t>(cell[3] << 4 | cell[0]);
+    }
+}
+
+void mk61_emu::set_program(const mk61_program_t &image)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        throw std::logic_error("Calculator is off");
+    if (m_step_ticks != 0)
+        throw std::logic_error("Program can be written between steps only");
+    for (uint8_t i = 0; i < MK61_PROGRAM_SIZE; i++)
+    {
+        io_t *cell;
+        if (m_mode == mk61emu_mode_t::mode_61)
+            cell = program_cell<mk61emu_mode_t::mode_61>(i);
+        else if (i < mk61_chipset<mk61emu_mode_t::mode_54>::program_size)
+            cell = program_cell<mk61emu_mode_t::mode_54>(i);
+        else if (image[i] != 0)
+            throw std::logic_error("No such program step in MK54 mode");
+        else
+            continue;
+        cell[0] = image[i] & 0xf;
+        cell[3] = image[i] >> 4;
+    }
+    reset_idle();
+    checkpoint();
+}
+
 angle_unit_t mk61_emu::get_angle_unit()
 {
     return m_angle_unit;
@@ -1465,7 +2060,11 @@ angle_unit_t mk61_emu::get_angle_unit()
 
 void mk61_emu::set_angle_unit(const angle_unit_t value)
 {
+    if (value == m_angle_unit)
+        return;
+    reset_idle();
     m_angle_unit = value;
+    checkpoint();
 }
 
 const char* mk61_emu::get_indicator_str()
@@ -1476,10 +2075,10 @@ const char* mk61_emu::get_indicator_str()
         return m_indicator_str;
     int i = 0;
     for (i = 0; i < 9; i++)
-        m_indicator_str[i] = display_symbols[this->m_IK1302->R[(8 - i) * 3]];
+        m_indicator_str[i] = display_symbols[m_chips.IK1302.R[(8 - i) * 3]];
     for (i = 0; i < 3; i++)
-        m_indicator_str[i + 10] = display_symbols[this->m_IK1302->R[(11 - i) * 3]];
-    int comma_pos = 9 - this->m_IK1302->comma + 1;
+        m_indicator_str[i + 10] = display_symbols[m_chips.IK1302.R[(11 - i) * 3]];
+    int comma_pos = 9 - m_chips.IK1302.comma + 1;
     for (i = 13; i >= comma_pos; i--)
         m_indicator_str[i] = this->m_indicator_str[i - 1];
     m_indicator_str[comma_pos] = ',';
@@ -1496,28 +2095,101 @@ const char* mk61_emu::get_prog_counter_str()
     return m_prog_counter_str;
 }
 
+const char* mk61_emu::get_return_str(const uint8_t index)
+{
+    if (get_power_state() == engine_power_state_t::engine_off || index >= MK61EMU_RETURNS_COUNT)
+        return "";
+    m_return_str[0] = m_returns[index][0];
+    m_return_str[1] = m_returns[index][1];
+    m_return_str[2] = 0;
+    return m_return_str;
+}
+
 void mk61_emu::set_state(std::istream& data)
 {
-    set_power_state(engine_power_state_t::engine_off);
-    set_power_state(engine_power_state_t::engine_on);
-    m_IR2_1->read_state(data);
-    m_IR2_2->read_state(data);
-    m_IK1302->read_state(data);
-    m_IK1303->read_state(data);
-    data >> m_angle_unit;
-    if (m_IK1306 != NULL)
-        m_IK1306->read_state(data);
+    mk61_snapshot snapshot;
+    if (!data.read(reinterpret_cast<char*>(&snapshot), sizeof(snapshot)))
+        throw std::logic_error("Snapshot is truncated");
+    set_snapshot(snapshot);
 }
 
 void mk61_emu::get_state(std::ostream& data)
 {
     if (get_power_state() == engine_power_state_t::engine_off)
         return;
-    m_IR2_1->write_state(data);
-    m_IR2_2->write_state(data);
-    m_IK1302->qrite_state(data);
-    m_IK1303->qrite_state(data);
-    data << m_angle_unit;
-    if (this->m_IK1306 != NULL)
-        m_IK1306->qrite_state(data);
+    mk61_snapshot snapshot;
+    get_snapshot(snapshot);
+    data.write(reinterpret_cast<const char*>(&snapshot), sizeof(snapshot));
+}
+
+void mk61_emu::get_snapshot(mk61_snapshot& snapshot) const
+{
+    memcpy(snapshot.magic, MK61_SNAPSHOT_MAGIC, sizeof(snapshot.magic));
+    snapshot.version = MK61_SNAPSHOT_VERSION;
+    snapshot.mode = static_cast<uint8_t>(m_mode);
+    snapshot.angle_unit = static_cast<int8_t>(m_angle_unit);
+    snapshot.step_ticks[0] = m_step_ticks & 0xff;
+    snapshot.step_ticks[1] = m_step_ticks >> 8;
+    m_chips.IR2_1.write_state(snapshot.IR2_1);
+    m_chips.IR2_2.write_state(snapshot.IR2_2);
+    m_chips.IK1302.write_state(snapshot.IK1302);
+    m_chips.IK1303.write_state(snapshot.IK1303);
+    m_chips.IK1306.write_state(snapshot.IK1306);
+}
+
+void mk61_emu::set_snapshot(const mk61_snapshot& snapshot)
+{
+    load_snapshot(snapshot);
+    checkpoint();
+}
+
+void mk61_emu::load_snapshot(const mk61_snapshot& snapshot)
+{
+    if (memcmp(snapshot.magic, MK61_SNAPSHOT_MAGIC, sizeof(snapshot.magic)) != 0)
+        throw std::logic_error("Not a snapshot of the calculator");
+    if (snapshot.version != MK61_SNAPSHOT_VERSION)
+        throw std::logic_error("Unsupported snapshot version");
+    if (snapshot.mode != static_cast<uint8_t>(m_mode))
+        throw std::logic_error("Snapshot of another calculator mode");
+    const uint32_t step_ticks = snapshot.step_ticks[0] | snapshot.step_ticks[1] << 8;
+    // mtick indexes the memories of the chips
+    const mk61_snapshot_IK13 *IK13s[] = { &snapshot.IK1302, &snapshot.IK1303, &snapshot.IK1306 };
+    bool valid = step_ticks < MK61EMU_STEP_TICKS && step_ticks % IK13_MTICK_COUNT == 0 &&
+                 snapshot.IR2_1.mtick < IR2_MTICK_COUNT && snapshot.IR2_2.mtick < IR2_MTICK_COUNT;
+    for (const mk61_snapshot_IK13 *chip : IK13s)
+        valid = valid && chip->mtick < IK13_MTICK_COUNT * 4 && chip->mtick % 4 == 0;
+    // the angle unit is the key column IK1303 reads before every step
+    const angle_unit_t angle_unit = static_cast<angle_unit_t>(snapshot.angle_unit);
+    valid = valid && (angle_unit == angle_unit_t::radian || angle_unit == angle_unit_t::degree ||
+                      angle_unit == angle_unit_t::grade);
+    if (!valid)
+        throw std::logic_error("Snapshot is corrupted");
+    set_power_state(engine_power_state_t::engine_on);
+    m_chips.IR2_1.read_state(snapshot.IR2_1);
+    m_chips.IR2_2.read_state(snapshot.IR2_2);
+    m_chips.IK1302.read_state(snapshot.IK1302);
+    m_chips.IK1303.read_state(snapshot.IK1303);
+    m_chips.IK1306.read_state(snapshot.IK1306);
+    m_angle_unit = angle_unit;
+    m_step_ticks = step_ticks;
+    reset_idle();
+    if (m_step_ticks == 0)
+        read_registers();
+    m_is_output_required = true;
+}
+
+void mk61_emu::get_chipset_state(mk61_chipset_state& state) const
+{
+    memcpy(&state, &m_chips, sizeof(m_chips));
+}
+
+void mk61_emu::set_chipset_state(const mk61_chipset_state& state)
+{
+    set_power_state(engine_power_state_t::engine_on);
+    memcpy(&m_chips, &state, sizeof(m_chips));
+    m_step_ticks = 0;
+    reset_idle();
+    read_registers();
+    checkpoint();
+    m_is_output_required = true;
 }
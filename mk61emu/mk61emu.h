@@ -5,6 +5,9 @@
 #define MK61EMU_VERSION_MINOR 2
 
 #include <iostream>
+#include <cstring>
+#include <memory>
+#include <type_traits>
 #include "mk_common.h"
 
 typedef uint32_t microinstruction_t; // 4-byte microinstructions
@@ -20,6 +23,55 @@ struct IK13_ROM
     uint8_t            microprograms[1152];
 };
 
+/**
+ * IK13 microinstruction decoded into ready-to-use masks and selectors.
+ * Source masks are either 0 or the full nibble (gamma: 0 or 1), so the
+ * adder inputs can be combined without testing the microinstruction bits.
+ */
+struct IK13_microinstruction
+{
+    io_t alpha_R, alpha_M, alpha_ST, alpha_NR, alpha_L, alpha_S, alpha_const;
+    io_t beta_S1, beta_NS, beta_S, beta_const;
+    io_t gamma_NT, gamma_NL, gamma_L;
+    io_t R_mode;   // R[I] write mode (0 - no write)
+    io_t R_prev1;  // write sigma to R[I - 1]
+    io_t R_prev2;  // write sigma to R[I - 2]
+    io_t M_write;  // write S to M[I]
+    io_t L_write;  // latch carry to L
+    io_t S_mode;
+    io_t S1_mode;
+    io_t ST_mode;
+};
+
+/**
+ * IK13
+ */
+const uint8_t IK13_MTICK_COUNT = 42;
+
+/**
+ * Microprogram of an IK13 instruction resolved for every tick of the cycle.
+ * Conditional microinstructions are stored for both values of the L latch.
+ */
+struct IK13_instruction_trace
+{
+    io_t AMK[IK13_MTICK_COUNT][2]; // [tick][L != 0]
+    io_t MOD;
+    io_t key_scan; // instruction polls the keyboard (bits 18..23 are clear)
+    io_t jump;     // the third address loads the jump target to R[37], R[40]
+    io_t jump_lo, jump_hi;
+};
+
+/**
+ * IK13 ROM with microinstructions and microprograms decoded once
+ */
+struct IK13_decoded_ROM
+{
+    IK13_microinstruction microinstructions[68];
+    IK13_instruction_trace instructions[256];
+    explicit IK13_decoded_ROM(const IK13_ROM& rom);
+    static const IK13_decoded_ROM* get(const IK13_ROM* rom);
+};
+
 /**
  * mk61ROM
  */
@@ -31,9 +83,45 @@ struct mk61ROM_t
 };
 
 /**
- * IK13
+ * Snapshot of the calculator: a fixed layout of bytes with no padding, so it can
+ * be saved and restored through any buffer, a memory-mapped file included.
+ * The memories of the chips are packed two nibbles per byte, the low one first.
  */
-const uint8_t IK13_MTICK_COUNT = 42;
+const char MK61_SNAPSHOT_MAGIC[4] = { 'M', 'K', '6', '1' };
+const uint8_t MK61_SNAPSHOT_VERSION = 1;
+
+struct mk61_snapshot_IK13
+{
+    uint8_t R[21];
+    uint8_t M[21];
+    uint8_t ST[21];
+    uint8_t S, S1, L, T, P;
+    uint8_t mtick;
+    uint8_t AMK, AK, MOD;
+    uint8_t input, output;
+    int8_t key_x, key_y, comma;
+};
+
+struct mk61_snapshot_IR2
+{
+    uint8_t M[126];
+    uint8_t mtick;
+    uint8_t input, output;
+};
+
+struct mk61_snapshot
+{
+    char magic[4];          // MK61_SNAPSHOT_MAGIC
+    uint8_t version;        // MK61_SNAPSHOT_VERSION
+    uint8_t mode;           // mk61emu_mode_t
+    int8_t angle_unit;      // angle_unit_t
+    uint8_t step_ticks[2];  // ticks made since the end of the last do_step, the low byte first
+    mk61_snapshot_IR2 IR2_1, IR2_2;
+    mk61_snapshot_IK13 IK1302, IK1303, IK1306;
+};
+
+static_assert(alignof(mk61_snapshot) == 1 && sizeof(mk61_snapshot) == 9 + 2 * 129 + 3 * 77,
+              "Snapshot must have no padding");
 
 /**
  * The IK13 chip
@@ -41,25 +129,27 @@ const uint8_t IK13_MTICK_COUNT = 42;
 class IK13
 {
     friend class mk61_emu;
-public:
-    IK13();
+    friend struct mk61_chipset_state;
+    friend class mk61_batch_emu;
 private:
-    void read_state(std::istream& data);
-    void qrite_state(std::ostream& data);
+    void reset();
+    void read_state(const mk61_snapshot_IK13& data);
+    void write_state(mk61_snapshot_IK13& data) const;
     void set_ROM(const IK13_ROM* value);
     void tick();
 private:
     const IK13_ROM *ROM;
+    const IK13_decoded_ROM *decoded;
     io_t R[IK13_MTICK_COUNT];
     io_t M[IK13_MTICK_COUNT];
     io_t ST[IK13_MTICK_COUNT];
     io_t S, S1, L, T, P;
     mtick_t mtick;
-    microinstruction_t microinstruction;
-    io_t AMK, ASP, AK, MOD;
+    io_t AMK, AK, MOD;
     io_t input;
     io_t output;
     int8_t key_x, key_y, comma;
+    int8_t key_seen; // the keyboard scan has found the key pressed, kept until the next key
 };
 
 /**
@@ -70,11 +160,12 @@ const uint8_t IR2_MTICK_COUNT = 252;
 class IR2
 {
     friend class mk61_emu;
-public:
-    IR2();
+    friend struct mk61_chipset_state;
+    friend class mk61_batch_emu;
 private:
-    void read_state(std::istream& data);
-    void write_state(std::ostream& data);
+    void reset();
+    void read_state(const mk61_snapshot_IR2& data);
+    void write_state(mk61_snapshot_IR2& data) const;
     void tick();
 private:
     io_t M[IR2_MTICK_COUNT];
@@ -92,6 +183,58 @@ enum class mk61emu_mode_t
     mode_54
 };
 
+/**
+ * State of all the chips of the calculator kept in one block: the chips have
+ * no constructors, so the whole machine can be cleared or copied with memset/memcpy.
+ * IK1306 is not used in the MK54 mode.
+ */
+struct alignas(64) mk61_chipset_state
+{
+    IR2  IR2_1;
+    IR2  IR2_2;
+    IK13 IK1302;
+    IK13 IK1303;
+    IK13 IK1306;
+    template <mk61emu_mode_t mode> void tick();
+    uint64_t hash() const;
+};
+
+static_assert(std::is_trivially_copyable<mk61_chipset_state>::value, "Chipset state must be trivially copyable");
+
+const uint32_t MK61EMU_STEP_TICKS = 560 * IK13_MTICK_COUNT; // chipset ticks made by do_step
+const uint32_t MK61EMU_SETTLE_TICKS = 1260;                  // period of the chipset rings
+const uint8_t MK61EMU_IDLE_STEPS = 3;                        // steps making a whole number of ring periods
+const uint8_t MK61EMU_INPUT_STEPS = 10;                      // steps a key of do_input is held or followed at most
+
+/**
+ * Key stream of do_input: every key is the key1 and key2 bytes, pressed for 1 step.
+ * Key1 with MK61_INPUT_HOLD set is followed by a byte of the steps to hold the key.
+ * A key is held longer until the keyboard scan finds it, and after the release
+ * the calculator is stepped until it waits for the next key.
+ */
+const uint8_t MK61_INPUT_HOLD = 0x80;
+
+struct mk61_input_key
+{
+    uint8_t key1, key2;
+    uint8_t hold; // steps the key is held
+    // Reads the key at buf, false at the end of the stream or on a cut key
+    static bool read(const char*& buf, const char* end, mk61_input_key& key);
+    static void write(std::string& stream, const uint8_t key1, const uint8_t key2, const uint8_t hold = 1);
+    static bool is_valid(const char* buf, size_t length);
+};
+
+/**
+ * Where do_step_until stops. It always stops at the start of an IK13 cycle.
+ */
+enum class mk61_step_until_t
+{
+    step,        // the end of do_step
+    cycle,       // the next instruction fetch of IK1302
+    instruction, // the program counter changes
+    settled      // the chipset state repeats, i.e. the calculator waits for a key
+};
+
 typedef char mk61_register_position_t;
 const int mk61_register_positions_count = 14;
 typedef mk61_register_position_t mk61_register_t[mk61_register_positions_count];
@@ -126,6 +269,22 @@ enum class mk61emu_reg_mem_t : uint8_t
     mk61emu_RE = 14
 };
 
+const uint8_t MK61EMU_RETURNS_COUNT = 5; // depth of the subroutine return stack
+
+/**
+ * Program memory image: an instruction code per program step
+ */
+const uint8_t MK61_PROGRAM_SIZE = 105;
+typedef uint8_t mk61_program_t[MK61_PROGRAM_SIZE];
+
+/**
+ * Digits of a register as kept in the chip memory: 8 digits of the mantissa,
+ * the sign of the mantissa, 2 digits of the exponent and its sign. The digits
+ * go least significant first and lie every 3rd cell of the memory.
+ */
+const uint8_t MK61EMU_REG_DIGITS = 12;
+typedef io_t mk61_register_digits_t[MK61EMU_REG_DIGITS];
+
 enum class angle_unit_t : int8_t
 {
     radian = 10,
@@ -139,44 +298,150 @@ struct mk61emu_result
     std::string message;
 };
 
+/**
+ * Register value as shown by the calculator
+ */
+struct mk61_number
+{
+    bool negative;
+    io_t mantissa[8]; // most significant digit first
+    int16_t exponent;
+    double to_double() const; // NaN if the mantissa is not a number, e.g. "ЕГГОГ"
+};
+
+enum class mk61_engine_kind_t
+{
+    microcode, // cycle accurate emulation of the chipset
+    opcode     // direct execution of the instructions
+};
+
+/**
+ * Common interface of the MK61 engines
+ */
+class mk61_engine : public mk_engine
+{
+public:
+    virtual const char* get_reg_stack_str(mk61emu_reg_stack_t reg) = 0;
+    virtual angle_unit_t get_angle_unit() = 0;
+    virtual void set_angle_unit(const angle_unit_t value) = 0;
+    virtual const char* get_indicator_str() = 0;
+    virtual const char* get_prog_counter_str() = 0;
+    virtual const char* get_return_str(const uint8_t index) = 0; // return addresses, the next one first
+    virtual const char* get_reg_mem_str(mk61emu_reg_mem_t reg) = 0;
+    virtual mk61_number get_reg_stack(mk61emu_reg_stack_t reg) = 0;
+    virtual mk61_number get_reg_mem(mk61emu_reg_mem_t reg) = 0;
+    virtual double get_reg_stack_value(mk61emu_reg_stack_t reg);
+    virtual double get_reg_mem_value(mk61emu_reg_mem_t reg);
+    // Write the register directly, between steps only. The indicator and the number
+    // entry are left as they are, so X shows up after the next operation
+    virtual void set_reg_stack(mk61emu_reg_stack_t reg, const mk61_number &value) = 0;
+    virtual void set_reg_mem(mk61emu_reg_mem_t reg, const mk61_number &value) = 0;
+    void set_reg_stack_value(mk61emu_reg_stack_t reg, const double value);
+    void set_reg_mem_value(mk61emu_reg_mem_t reg, const double value);
+    virtual void get_program(mk61_program_t &image) = 0;
+    virtual void set_program(const mk61_program_t &image) = 0; // between steps only, like the registers
+    virtual bool is_running() = 0;
+    virtual bool is_idle() = 0; // steps change nothing until the next input
+protected:
+    static bool to_number(const double value, mk61_number &result);
+    static void clear_register_str(mk61_register_t &reg);
+    static void format_number(mk61_register_t &reg, const mk61_number &value);
+    static mk61_register_position_t display_symbol(io_t value);
+};
+
+class mk61_step_cache;
+class mk61_history;
+
 /**
  * The MK61 emulator class
  */
-class mk61_emu : public mk_engine
+class mk61_emu : public mk61_engine
 {
 public:
     mk61_emu();
     virtual ~mk61_emu();
-    const char* get_reg_stack_str(mk61emu_reg_stack_t reg);
-    angle_unit_t get_angle_unit();
-    void set_angle_unit(const angle_unit_t value);
-    const char* get_indicator_str();
-    const char* get_prog_counter_str();
-    const char* get_reg_mem_str(mk61emu_reg_mem_t reg);
+    mk61_emu& operator =(const mk61_emu&) = delete;
+    // A calculator in the same state sharing the step cache, without the history
+    std::unique_ptr<mk61_emu> fork() const;
+    const char* get_reg_stack_str(mk61emu_reg_stack_t reg) override;
+    angle_unit_t get_angle_unit() override;
+    void set_angle_unit(const angle_unit_t value) override;
+    const char* get_indicator_str() override;
+    const char* get_prog_counter_str() override;
+    const char* get_return_str(const uint8_t index) override;
+    const char* get_reg_mem_str(mk61emu_reg_mem_t reg) override;
+    mk61_number get_reg_stack(mk61emu_reg_stack_t reg) override;
+    mk61_number get_reg_mem(mk61emu_reg_mem_t reg) override;
+    void set_reg_stack(mk61emu_reg_stack_t reg, const mk61_number &value) override;
+    void set_reg_mem(mk61emu_reg_mem_t reg, const mk61_number &value) override;
+    void get_program(mk61_program_t &image) override;
+    void set_program(const mk61_program_t &image) override;
     mk_result_t do_step() override;
+    uint32_t do_step_until(const mk61_step_until_t until, const uint32_t count, const uint32_t max_ticks);
     virtual mk_result_t do_input(const char* buf, size_t length);
+    uint32_t get_input_ticks() const { return m_input_ticks; } // chipset ticks made by the last do_input
     virtual mk_result_t do_key_press(const uint8_t key1, const uint8_t key2);
     virtual bool is_output_required();
     virtual mk_result_t set_power_state(const engine_power_state_t value);
-    bool is_running();
+    bool is_running() override;
+    bool is_idle() override;
+    void set_step_cache(std::shared_ptr<mk61_step_cache> value);
+    // Reverse execution: with a history attached the emulator counts the steps
+    // and records the snapshots at them
+    void set_history(std::shared_ptr<mk61_history> value);
+    uint64_t get_step_count() const { return m_step_count; }
+    void step_back(const uint64_t count);
+    void go_to_step(const uint64_t step);
     void get_state(std::ostream& data);
     void set_state(std::istream& data);
+    void get_snapshot(mk61_snapshot& snapshot) const;
+    void set_snapshot(const mk61_snapshot& snapshot);
+    void get_chipset_state(mk61_chipset_state& state) const;
+    void set_chipset_state(const mk61_chipset_state& state);
 private:
+    mk61_emu(const mk61_emu&) = default;
     void clear_registers();
-    static void clear_register_str(mk61_register_t &reg);
     void cleanup();
-    void read_all_fields(uint8_t replacement);
-    void read_number(mk61_register_t &reg, uint8_t chip, unsigned char address);
-    void tick();
+    void reset_idle();
+    void record_step();
+    void count_step();
+    void checkpoint();
+    uint32_t input_key(const mk61_input_key& key);
+    void load_snapshot(const mk61_snapshot& snapshot);
+    template <mk61emu_mode_t mode> void read_all_fields(uint8_t replacement);
+    void read_registers();
+    io_t* chip_memory(uint8_t chip);
+    bool read_digits(mk61_register_digits_t &digits, uint8_t chip, unsigned char address);
+    void write_digits(const mk61_register_digits_t &digits, uint8_t chip, unsigned char address);
+    template <mk61emu_mode_t mode> void write_register(const mk61_register_digits_t &digits, const bool stack, const uint8_t index);
+    void write_register(const mk61_number &value, const bool stack, const uint8_t index);
+    template <mk61emu_mode_t mode> io_t* program_cell(const uint8_t step);
+    static void decode_number(mk61_number &value, const mk61_register_digits_t &digits);
+    static void encode_number(mk61_register_digits_t &digits, const mk61_number &value);
+    template <mk61emu_mode_t mode> uint32_t advance(const mk61_step_until_t until, uint32_t count, const uint32_t max_ticks);
 private:
     mk61emu_mode_t m_mode;
     angle_unit_t m_angle_unit;
-    IR2 *m_IR2_1, *m_IR2_2;
-    IK13 *m_IK1302, *m_IK1303, *m_IK1306;
+    mk61_chipset_state m_chips;
+    uint32_t m_step_ticks; // ticks made since the end of the last do_step
+    // Idle detection: chipset state after the last steps made without input
+    mk61_chipset_state m_history[MK61EMU_IDLE_STEPS];
+    uint8_t m_history_count;
+    uint8_t m_history_last;
+    bool m_idle;
+    std::shared_ptr<mk61_step_cache> m_step_cache; // optional, shared by emulators
+    std::shared_ptr<mk61_history> m_step_history; // optional
+    uint64_t m_step_count; // steps made since power on, counted with a history only
+    uint32_t m_input_ticks;
+    // Registers are decoded from their digits when read and only if the digits changed
+    mk61_register_digits_t m_reg_stack_digits[MK61EMU_REG_STACK_COUNT];
+    mk61_register_digits_t m_reg_mem_digits[MK61EMU_REG_MEM_COUNT];
+    uint32_t m_reg_dirty; // a bit per register: memory registers, then stack registers
     mk61_register_t m_reg_stack[MK61EMU_REG_STACK_COUNT]; // X1, X, Y, Z, T;
     mk61_register_t m_reg_mem[MK61EMU_REG_MEM_COUNT];  // R1, R2, R3, R4, R5, R6, R7, R8, R9, RA, RB, RC, RD, RE;
     mk61_register_position_t m_prog_counter[2];
-    mk61_register_position_t m_returns[5][2];
+    mk61_register_position_t m_returns[MK61EMU_RETURNS_COUNT][2];
+    char m_return_str[3];
     char m_prog_counter_str[3];
     char m_indicator_str[15];
     bool m_RSModeChanged;
@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <numeric>
+#include "mk61history.h"
+
+/**
+ * Frame: the snapshot with every nibble in its own byte. The memories of the chips
+ * go in the order they shift through the ring: every memory from the cell output
+ * next, IR2_2 first, then IR2_1, IK1306 (not in the ring of MK54), IK1303, IK1302.
+ * In 1 tick the ring moves 1 cell towards the start.
+ */
+namespace
+{
+    const uint16_t frame_ring = 57; // the scalar fields of the snapshot go first
+
+    void unpack(const uint8_t *packed, io_t *nibbles, const size_t count)
+    {
+        for (size_t i = 0; i < count; i += 2)
+        {
+            nibbles[i] = packed[i / 2] & 0xf;
+            nibbles[i + 1] = packed[i / 2] >> 4;
+        }
+    }
+
+    void pack(const io_t *nibbles, uint8_t *packed, const size_t count)
+    {
+        for (size_t i = 0; i < count; i += 2)
+            packed[i / 2] = static_cast<uint8_t>(nibbles[i] | nibbles[i + 1] << 4);
+    }
+}
+
+/*
+* mk61_history
+*/
+mk61_history::mk61_history(size_t capacity, uint32_t interval)
+    : m_capacity(capacity), m_interval(interval != 0 ? interval : 1), m_memory(0), m_since_keyframe(0)
+{
+    memset(m_last, 0, sizeof(m_last));
+}
+
+uint64_t mk61_history::get_first() const
+{
+    return m_entries.empty() ? 0 : m_entries.front().step;
+}
+
+uint64_t mk61_history::get_last() const
+{
+    return m_entries.empty() ? 0 : m_entries.back().step;
+}
+
+void mk61_history::record(const uint64_t step, const mk61_snapshot& snapshot)
+{
+    auto next = std::upper_bound(m_entries.begin(), m_entries.end(), step,
+                                 [](const uint64_t value, const entry& e) { return value < e.step; });
+    truncate(next - m_entries.begin());
+    entry item;
+    item.step = step;
+    item.shift = 0;
+    frame_t frame;
+    to_frame(snapshot, frame);
+    item.keyframe = m_entries.empty() || m_since_keyframe + 1 >= MK61_HISTORY_KEYFRAME;
+    if (item.keyframe)
+    {
+        const uint8_t *data = reinterpret_cast<const uint8_t*>(&snapshot);
+        item.data.assign(data, data + sizeof(snapshot));
+        m_since_keyframe = 0;
+    }
+    else
+    {
+        frame_t predicted;
+        item.shift = find_shift(m_last, frame);
+        shift_ring(m_last, item.shift, predicted);
+        encode(predicted, frame, item.data);
+        m_since_keyframe++;
+    }
+    memcpy(m_last, frame, sizeof(frame));
+    m_memory += item.data.size();
+    m_entries.push_back(std::move(item));
+
+    // Drop the oldest keyframe groups, the last one is always kept
+    while (m_entries.size() > m_capacity)
+    {
+        auto next = std::find_if(m_entries.begin() + 1, m_entries.end(), [](const entry& e) { return e.keyframe; });
+        if (next == m_entries.end())
+            break;
+        for (auto i = m_entries.begin(); i != next; ++i)
+            m_memory -= i->data.size();
+        m_entries.erase(m_entries.begin(), next);
+    }
+}
+
+bool mk61_history::find(const uint64_t step, uint64_t& found, mk61_snapshot& snapshot) const
+{
+    auto next = std::upper_bound(m_entries.begin(), m_entries.end(), step,
+                                 [](const uint64_t value, const entry& e) { return value < e.step; });
+    if (next == m_entries.begin())
+        return false;
+    const size_t index = next - m_entries.begin() - 1;
+    frame_t frame;
+    restore(index, frame);
+    from_frame(frame, snapshot);
+    found = m_entries[index].step;
+    return true;
+}
+
+void mk61_history::clear()
+{
+    m_entries.clear();
+    m_memory = 0;
+    m_since_keyframe = 0;
+}
+
+void mk61_history::truncate(const size_t size)
+{
+    if (size >= m_entries.size())
+        return;
+    for (size_t i = size; i < m_entries.size(); i++)
+        m_memory -= m_entries[i].data.size();
+    m_entries.resize(size);
+    // the next snapshot is encoded against the last one kept
+    m_since_keyframe = 0;
+    if (m_entries.empty())
+        return;
+    restore(size - 1, m_last);
+    for (size_t i = size - 1; !m_entries[i].keyframe; i--)
+        m_since_keyframe++;
+}
+
+void mk61_history::restore(const size_t index, frame_t& frame) const
+{
+    size_t first = index;
+    while (!m_entries[first].keyframe)
+        first--;
+    mk61_snapshot snapshot;
+    memcpy(&snapshot, m_entries[first].data.data(), sizeof(snapshot));
+    to_frame(snapshot, frame);
+    for (size_t i = first + 1; i <= index; i++)
+    {
+        frame_t predicted;
+        shift_ring(frame, m_entries[i].shift, predicted);
+        decode(predicted, m_entries[i].data, frame);
+    }
+}
+
+void mk61_history::to_frame(const mk61_snapshot& snapshot, frame_t& frame)
+{
+    // The snapshot fields other than the memories are bytes already
+    uint8_t *p = frame;
+    memcpy(p, &snapshot, 9);
+    p += 9;
+    for (const mk61_snapshot_IR2 *chip : { &snapshot.IR2_1, &snapshot.IR2_2 })
+    {
+        memcpy(p, &chip->mtick, 3);
+        p += 3;
+    }
+    for (const mk61_snapshot_IK13 *chip : { &snapshot.IK1302, &snapshot.IK1303, &snapshot.IK1306 })
+    {
+        memcpy(p, &chip->S, 14);
+        p += 14;
+    }
+
+    const bool has_IK1306 = snapshot.mode == static_cast<uint8_t>(mk61emu_mode_t::mode_61);
+    const mk61_snapshot_IK13 *ring_IK13[] = { has_IK1306 ? &snapshot.IK1306 : &snapshot.IK1303,
+                                              has_IK1306 ? &snapshot.IK1303 : &snapshot.IK1302,
+                                              has_IK1306 ? &snapshot.IK1302 : &snapshot.IK1306 };
+    io_t memory[IR2_MTICK_COUNT];
+    for (const mk61_snapshot_IR2 *chip : { &snapshot.IR2_2, &snapshot.IR2_1 })
+    {
+        unpack(chip->M, memory, IR2_MTICK_COUNT);
+        for (uint16_t i = 0; i < IR2_MTICK_COUNT; i++)
+            *p++ = memory[(chip->mtick + i) % IR2_MTICK_COUNT];
+    }
+    for (const mk61_snapshot_IK13 *chip : ring_IK13)
+    {
+        unpack(chip->M, memory, IK13_MTICK_COUNT);
+        for (uint16_t i = 0; i < IK13_MTICK_COUNT; i++)
+            *p++ = memory[((chip->mtick >> 2) + i) % IK13_MTICK_COUNT];
+    }
+    for (const mk61_snapshot_IK13 *chip : { &snapshot.IK1302, &snapshot.IK1303, &snapshot.IK1306 })
+    {
+        unpack(chip->R, p, IK13_MTICK_COUNT);
+        p += IK13_MTICK_COUNT;
+        unpack(chip->ST, p, IK13_MTICK_COUNT);
+        p += IK13_MTICK_COUNT;
+    }
+}
+
+void mk61_history::from_frame(const frame_t& frame, mk61_snapshot& snapshot)
+{
+    const uint8_t *p = frame;
+    memcpy(&snapshot, p, 9);
+    p += 9;
+    for (mk61_snapshot_IR2 *chip : { &snapshot.IR2_1, &snapshot.IR2_2 })
+    {
+        memcpy(&chip->mtick, p, 3);
+        p += 3;
+    }
+    for (mk61_snapshot_IK13 *chip : { &snapshot.IK1302, &snapshot.IK1303, &snapshot.IK1306 })
+    {
+        memcpy(&chip->S, p, 14);
+        p += 14;
+    }
+
+    const bool has_IK1306 = snapshot.mode == static_cast<uint8_t>(mk61emu_mode_t::mode_61);
+    mk61_snapshot_IK13 *ring_IK13[] = { has_IK1306 ? &snapshot.IK1306 : &snapshot.IK1303,
+                                        has_IK1306 ? &snapshot.IK1303 : &snapshot.IK1302,
+                                        has_IK1306 ? &snapshot.IK1302 : &snapshot.IK1306 };
+    io_t memory[IR2_MTICK_COUNT];
+    for (mk61_snapshot_IR2 *chip : { &snapshot.IR2_2, &snapshot.IR2_1 })
+    {
+        for (uint16_t i = 0; i < IR2_MTICK_COUNT; i++)
+            memory[(chip->mtick + i) % IR2_MTICK_COUNT] = *p++;
+        pack(memory, chip->M, IR2_MTICK_COUNT);
+    }
+    for (mk61_snapshot_IK13 *chip : ring_IK13)
+    {
+        for (uint16_t i = 0; i < IK13_MTICK_COUNT; i++)
+            memory[((chip->mtick >> 2) + i) % IK13_MTICK_COUNT] = *p++;
+        pack(memory, chip->M, IK13_MTICK_COUNT);
+    }
+    for (mk61_snapshot_IK13 *chip : { &snapshot.IK1302, &snapshot.IK1303, &snapshot.IK1306 })
+    {
+        pack(p, chip->R, IK13_MTICK_COUNT);
+        p += IK13_MTICK_COUNT;
+        pack(p, chip->ST, IK13_MTICK_COUNT);
+        p += IK13_MTICK_COUNT;
+    }
+}
+
+uint16_t mk61_history::ring_size(const frame_t& frame)
+{
+    const bool has_IK1306 = frame[5] == static_cast<uint8_t>(mk61emu_mode_t::mode_61);
+    return 2 * IR2_MTICK_COUNT + (has_IK1306 ? 3 : 2) * IK13_MTICK_COUNT;
+}
+
+uint16_t mk61_history::find_shift(const frame_t& previous, const frame_t& frame)
+{
+    // IR2_1.mtick gives the ticks made modulo the IR2 size, the ring is longer
+    const uint16_t size = ring_size(frame);
+    const uint8_t *ring = frame + frame_ring;
+    const uint8_t *previous_ring = previous + frame_ring;
+    const uint16_t ticks = (frame[9] + IR2_MTICK_COUNT - previous[9]) % IR2_MTICK_COUNT;
+    const uint16_t candidates = size / std::gcd(size, static_cast<uint16_t>(IR2_MTICK_COUNT));
+    uint16_t best_shift = 0;
+    uint16_t best_changes = UINT16_MAX;
+    for (uint16_t k = 0; k < candidates; k++)
+    {
+        const uint16_t shift = (ticks + k * IR2_MTICK_COUNT) % size;
+        uint16_t changes = 0;
+        for (uint16_t i = 0; i < size && changes < best_changes; i++)
+            changes += ring[i] != previous_ring[(i + shift) % size];
+        if (changes < best_changes)
+        {
+            best_changes = changes;
+            best_shift = shift;
+        }
+    }
+    return best_shift;
+}
+
+void mk61_history::shift_ring(const frame_t& previous, const uint16_t shift, frame_t& result)
+{
+    const uint16_t size = ring_size(previous);
+    memcpy(result, previous, sizeof(frame_t));
+    for (uint16_t i = 0; i < size; i++)
+        result[frame_ring + i] = previous[frame_ring + (i + shift) % size];
+}
+
+/**
+ * XOR of the frames as runs: the count of zero bytes, the count of the bytes
+ * following them, the bytes. Zeros at the end are dropped.
+ */
+void mk61_history::encode(const frame_t& previous, const frame_t& frame, std::vector<uint8_t>& data)
+{
+    uint16_t i = 0;
+    while (i < frame_size)
+    {
+        uint8_t zeros = 0;
+        while (i < frame_size && frame[i] == previous[i] && zeros < UINT8_MAX)
+        {
+            zeros++;
+            i++;
+        }
+        const uint16_t start = i;
+        while (i < frame_size && frame[i] != previous[i] && i - start < UINT8_MAX)
+            i++;
+        if (i == frame_size && start == i)
+            break;
+        data.push_back(zeros);
+        data.push_back(static_cast<uint8_t>(i - start));
+        for (uint16_t j = start; j < i; j++)
+            data.push_back(frame[j] ^ previous[j]);
+    }
+}
+
+void mk61_history::decode(const frame_t& previous, const std::vector<uint8_t>& data, frame_t& frame)
+{
+    memcpy(frame, previous, sizeof(frame_t));
+    uint16_t position = 0;
+    for (size_t i = 0; i + 1 < data.size(); )
+    {
+        position += data[i];
+        const uint8_t count = data[i + 1];
+        i += 2;
+        for (uint8_t j = 0; j < count; j++)
+            frame[position++] ^= data[i++];
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef MK61HISTORY_H_INCLUDED
+#define MK61HISTORY_H_INCLUDED
+
+#include <deque>
+#include <vector>
+#include "mk61emu.h"
+
+/**
+ * Bounded history of calculator snapshots for the reverse execution. Every
+ * MK61_HISTORY_KEYFRAME-th snapshot is kept whole, the others as run-length
+ * encoded XOR with the previous one. The chip memories shift through the ring
+ * every tick, so they are XORed with the previous memories shifted the same way,
+ * leaving only the digits the calculator changed. The oldest snapshots are
+ * dropped a keyframe group at a time.
+ */
+const uint16_t MK61_HISTORY_KEYFRAME = 64;
+
+class mk61_history
+{
+public:
+    explicit mk61_history(size_t capacity = 100000, uint32_t interval = 1);
+    mk61_history(const mk61_history&) = delete;
+    mk61_history& operator =(const mk61_history&) = delete;
+public:
+    uint32_t get_interval() const { return m_interval; } // steps between snapshots
+    size_t get_size() const { return m_entries.size(); }
+    size_t get_memory() const { return m_memory; }       // bytes taken by the snapshots
+    bool is_empty() const { return m_entries.empty(); }
+    uint64_t get_first() const;                          // the oldest step kept
+    uint64_t get_last() const;                           // the latest step kept
+    // Drops the snapshots after the step first: they are not the future of this one
+    void record(const uint64_t step, const mk61_snapshot& snapshot);
+    // Finds the latest snapshot at or before the step
+    bool find(const uint64_t step, uint64_t& found, mk61_snapshot& snapshot) const;
+    void clear();
+public:
+    static const uint16_t frame_size = 939;
+    typedef uint8_t frame_t[frame_size];
+private:
+    struct entry
+    {
+        uint64_t step;
+        uint16_t shift;            // of the ring memories against the previous snapshot
+        bool keyframe;
+        std::vector<uint8_t> data; // the snapshot if keyframe, the encoded XOR otherwise
+    };
+private:
+    static void to_frame(const mk61_snapshot& snapshot, frame_t& frame);
+    static void from_frame(const frame_t& frame, mk61_snapshot& snapshot);
+    static uint16_t ring_size(const frame_t& frame);
+    static uint16_t find_shift(const frame_t& previous, const frame_t& frame);
+    static void shift_ring(const frame_t& previous, const uint16_t shift, frame_t& result);
+    static void encode(const frame_t& previous, const frame_t& frame, std::vector<uint8_t>& data);
+    static void decode(const frame_t& previous, const std::vector<uint8_t>& data, frame_t& frame);
+    void restore(const size_t index, frame_t& frame) const;
+    void truncate(const size_t size);
+private:
+    size_t m_capacity;
+    uint32_t m_interval;
+    std::deque<entry> m_entries;
+    size_t m_memory;
+    uint16_t m_since_keyframe;
+    frame_t m_last; // frame of the last snapshot recorded
+};
+
+#endif // MK61HISTORY_H_INCLUDED
@@ -0,0 +1,172 @@
+#include <stdexcept>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include "mk61jobs.h"
+
+/*
+* mk61_job_pool
+*/
+mk61_job_pool::mk61_job_pool(unsigned threads)
+    : m_threads(threads != 0 ? threads : std::thread::hardware_concurrency())
+{
+    if (m_threads == 0)
+        m_threads = 1;
+}
+
+std::vector<mk61_job_result> mk61_job_pool::run(const std::vector<mk61_job>& jobs)
+{
+    std::vector<mk61_job_result> results(jobs.size());
+    const size_t workers = std::min<size_t>(m_threads, jobs.size());
+    if (workers == 0)
+        return results;
+    m_queues.clear();
+    for (size_t i = 0; i < workers; i++)
+        m_queues.push_back(std::make_unique<job_queue>());
+    // Deal the jobs round-robin, so neighbouring (often similar) jobs land on different threads
+    for (size_t i = 0; i < jobs.size(); i++)
+        m_queues[i % workers]->jobs.push_back(i);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++)
+        threads.emplace_back(&mk61_job_pool::worker_run, this, i, std::cref(jobs), std::ref(results));
+    worker_run(0, jobs, results);
+    for (std::thread& thread : threads)
+        thread.join();
+    m_queues.clear();
+    return results;
+}
+
+bool mk61_job_pool::next_job(size_t worker, size_t& job)
+{
+    {
+        job_queue& own = *m_queues[worker];
+        std::lock_guard lock(own.lock);
+        if (!own.jobs.empty())
+        {
+            job = own.jobs.back();
+            own.jobs.pop_back();
+            return true;
+        }
+    }
+    // Steal from the other end of the queues of the other threads
+    for (size_t i = 1; i < m_queues.size(); i++)
+    {
+        job_queue& victim = *m_queues[(worker + i) % m_queues.size()];
+        std::lock_guard lock(victim.lock);
+        if (!victim.jobs.empty())
+        {
+            job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void mk61_job_pool::worker_run(size_t worker, const std::vector<mk61_job>& jobs, std::vector<mk61_job_result>& results)
+{
+    size_t job;
+    while (next_job(worker, job))
+    {
+        try
+        {
+            run_job(jobs[job], results[job]);
+        }
+        catch (std::exception& e)
+        {
+            results[job].error = e.what();
+        }
+    }
+}
+
+void mk61_job_pool::check_initial_state()
+{
+    mk61_emu source;
+    source.set_power_state(engine_power_state_t::engine_on);
+    source.do_key_press(5, 1); // 3
+    for (uint32_t i = 0; i < 10; i++)
+        source.do_step();
+    // the memories of the state are in another phase after every step
+    for (int phase = 0; phase < 3; phase++)
+    {
+        source.do_step();
+        auto state = std::make_shared<mk61_chipset_state>();
+        source.get_chipset_state(*state);
+        mk61_job job;
+        job.initial_state = state;
+        job.stop = [](mk61_engine&) { return true; };
+        mk61_job_result result;
+        run_job(job, result);
+        const std::string expected = source.get_reg_stack_str(mk61emu_reg_stack_t::RX);
+        const std::string& reported = result.reg_stack[static_cast<int>(mk61emu_reg_stack_t::RX)];
+        if (result.steps != 0 || reported != expected)
+            throw std::logic_error("Job reports RX '" + reported + "' of the initial state '" + expected + "'");
+    }
+}
+
+void mk61_job_pool::run_job(const mk61_job& job, mk61_job_result& result)
+{
+    const auto started = std::chrono::steady_clock::now();
+    std::unique_ptr<mk61_engine> engine;
+    if (job.engine_kind == mk61_engine_kind_t::opcode)
+    {
+        if (job.initial_state)
+            throw std::logic_error("Opcode engine has no chipset state");
+        engine = std::make_unique<mk61_opcode_emu>();
+    }
+    else
+        engine = std::make_unique<mk61_emu>();
+
+    engine->set_power_state(engine_power_state_t::engine_on);
+    if (job.initial_state)
+        static_cast<mk61_emu&>(*engine).set_chipset_state(*job.initial_state);
+    engine->set_angle_unit(job.angle_unit);
+    for (const mk61_job_reg_stack& reg : job.reg_stack)
+        engine->set_reg_stack(reg.reg, reg.value);
+    for (const mk61_job_reg_mem& reg : job.reg_mem)
+        engine->set_reg_mem(reg.reg, reg.value);
+
+    result.steps = 0;
+    bool keys_entered = true;
+    for (const mk61_key& key : job.keys)
+    {
+        if (result.steps + 1 + job.steps_per_key > job.step_budget)
+        {
+            keys_entered = false;
+            break;
+        }
+        engine->do_key_press(key.key1, key.key2);
+        for (uint32_t i = 0; i < job.steps_per_key; i++)
+            engine->do_step();
+        result.steps += 1 + job.steps_per_key;
+    }
+    while (keys_entered)
+    {
+        if (job.stop ? job.stop(*engine) : !engine->is_running())
+        {
+            result.completed = true;
+            break;
+        }
+        if (result.steps >= job.step_budget)
+            break;
+        engine->do_step();
+        result.steps++;
+    }
+
+    result.running = engine->is_running();
+    for (uint8_t i = 0; i < MK61EMU_REG_STACK_COUNT; i++)
+    {
+        result.reg_stack[i] = engine->get_reg_stack_str(static_cast<mk61emu_reg_stack_t>(i));
+        result.reg_stack_value[i] = engine->get_reg_stack_value(static_cast<mk61emu_reg_stack_t>(i));
+    }
+    for (uint8_t i = 0; i < MK61EMU_REG_MEM_COUNT; i++)
+    {
+        result.reg_mem[i] = engine->get_reg_mem_str(static_cast<mk61emu_reg_mem_t>(i));
+        result.reg_mem_value[i] = engine->get_reg_mem_value(static_cast<mk61emu_reg_mem_t>(i));
+    }
+    result.indicator = engine->get_indicator_str();
+    result.prog_counter = engine->get_prog_counter_str();
+    result.microseconds = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - started).count();
+}
@@ -0,0 +1,100 @@
+#ifndef MK61JOBS_H_INCLUDED
+#define MK61JOBS_H_INCLUDED
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <functional>
+#include "mk61emu.h"
+#include "mk61opcode.h"
+
+/**
+ * Key of the calculator keyboard
+ */
+struct mk61_key
+{
+    uint8_t key1;
+    uint8_t key2;
+};
+
+/**
+ * Register value set before the keys of a job
+ */
+struct mk61_job_reg_stack
+{
+    mk61emu_reg_stack_t reg;
+    mk61_number value;
+};
+
+struct mk61_job_reg_mem
+{
+    mk61emu_reg_mem_t reg;
+    mk61_number value;
+};
+
+/**
+ * Independent calculator run: the calculator is powered on, optionally loaded
+ * with a saved chipset state and register values, then the keys are pressed one
+ * by one and the emulation continues until the stop condition holds or the budget is spent.
+ */
+struct mk61_job
+{
+    mk61_engine_kind_t engine_kind = mk61_engine_kind_t::microcode;
+    std::shared_ptr<const mk61_chipset_state> initial_state; // microcode engine only
+    angle_unit_t angle_unit = angle_unit_t::radian;
+    std::vector<mk61_job_reg_stack> reg_stack;      // set after the initial state, any engine
+    std::vector<mk61_job_reg_mem> reg_mem;
+    std::vector<mk61_key> keys;                     // program and input data
+    uint32_t steps_per_key = 10;                    // do_step calls after every key press
+    std::function<bool(mk61_engine&)> stop;         // checked after the keys, default: the program is stopped
+    uint32_t step_budget = 100000;                  // do_step calls including the key presses
+};
+
+struct mk61_job_result
+{
+    bool completed = false;        // the stop condition holds
+    bool running = false;
+    uint32_t steps = 0;            // do_step calls made
+    uint64_t microseconds = 0;     // time spent by the run
+    std::string error;             // the run failed if not empty
+    std::string reg_stack[MK61EMU_REG_STACK_COUNT];
+    std::string reg_mem[MK61EMU_REG_MEM_COUNT];
+    double reg_stack_value[MK61EMU_REG_STACK_COUNT] = {}; // NaN on error
+    double reg_mem_value[MK61EMU_REG_MEM_COUNT] = {};
+    std::string indicator;
+    std::string prog_counter;
+};
+
+/**
+ * Runs the jobs on a pool of threads. Every thread owns a queue of jobs and
+ * steals from the other queues when its own queue is drained.
+ */
+class mk61_job_pool
+{
+public:
+    explicit mk61_job_pool(unsigned threads = 0); // 0 - one thread per core
+    mk61_job_pool(const mk61_job_pool&) = delete;
+    mk61_job_pool& operator =(const mk61_job_pool&) = delete;
+public:
+    unsigned get_threads() const { return m_threads; }
+    std::vector<mk61_job_result> run(const std::vector<mk61_job>& jobs);
+    static void run_job(const mk61_job& job, mk61_job_result& result);
+    // Throws if a job stopped at once does not report the registers of its initial state
+    static void check_initial_state();
+private:
+    struct job_queue
+    {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+private:
+    bool next_job(size_t worker, size_t& job);
+    void worker_run(size_t worker, const std::vector<mk61_job>& jobs, std::vector<mk61_job_result>& results);
+private:
+    unsigned m_threads;
+    std::vector<std::unique_ptr<job_queue>> m_queues;
+};
+
+#endif // MK61JOBS_H_INCLUDED
@@ -0,0 +1,1025 @@
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include "mk61opcode.h"
+
+const uint8_t X1 = static_cast<uint8_t>(mk61emu_reg_stack_t::RX1);
+const uint8_t X = static_cast<uint8_t>(mk61emu_reg_stack_t::RX);
+const uint8_t Y = static_cast<uint8_t>(mk61emu_reg_stack_t::RY);
+const uint8_t Z = static_cast<uint8_t>(mk61emu_reg_stack_t::RZ);
+const uint8_t T = static_cast<uint8_t>(mk61emu_reg_stack_t::RT);
+
+const double PI = 3.14159265358979323846;
+
+/**
+ * Keyboard layout. Keys are addressed by {key1, key2} where key1 is 2..11
+ * and key2 is the row: 1 - digits, 8 - operations, 9 - program control.
+ */
+const int16_t key_none = -1;
+const int16_t key_reg = 0x100; // register key is expected to complete the instruction
+const int16_t key_AUT = 0x200;
+const int16_t key_PRG = 0x201;
+const int16_t key_STEPL = 0x202;
+const int16_t key_STEPR = 0x203;
+
+static const int16_t keys_row8[10] =
+{
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E
+};
+
+static const int16_t keys_row9[10] =
+{
+    0x50, 0x51, 0x52, 0x53, key_reg | 0x40, key_STEPL, key_reg | 0x60, key_STEPR, key_none, key_none
+};
+
+static const int16_t keys_F_row8[10] =
+{
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, key_AUT, key_PRG, key_none, 0x0F
+};
+
+static const int16_t keys_F_row9[10] =
+{
+    0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, key_none, key_none
+};
+
+static const int16_t keys_K_row1[10] =
+{
+    0x54, 0x55, 0x56, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36
+};
+
+static const int16_t keys_K_row8[10] =
+{
+    0x26, key_none, key_none, key_none, 0x2A, 0x37, 0x38, 0x39, 0x3A, 0x3B
+};
+
+static const int16_t keys_K_row9[10] =
+{
+    key_reg | 0x70, key_reg | 0x80, key_reg | 0x90, key_reg | 0xA0,
+    key_reg | 0xB0, key_reg | 0xC0, key_reg | 0xD0, key_reg | 0xE0, key_none, key_none
+};
+
+static int8_t digit_key(const uint8_t key1, const uint8_t key2)
+{
+    if (key2 == 1 && key1 >= 2 && key1 <= 11)
+        return key1 - 2;
+    return -1;
+}
+
+static int8_t register_key(const uint8_t key1, const uint8_t key2)
+{
+    if (key2 == 8 && key1 >= 7 && key1 <= 11)
+        return key1 + 3; // RA..RE
+    return digit_key(key1, key2);
+}
+
+static bool is_address_instruction(const uint8_t opcode)
+{
+    return opcode == 0x51 || opcode == 0x53 || (opcode >= 0x57 && opcode <= 0x5E);
+}
+
+/**
+ * mk61_opcode_emu
+ */
+mk61_opcode_emu::mk61_opcode_emu()
+{
+    clear_state();
+    mk_engine::set_power_state(engine_power_state_t::engine_off);
+}
+
+mk61_opcode_emu::~mk61_opcode_emu()
+{
+    set_power_state(engine_power_state_t::engine_off);
+}
+
+void mk61_opcode_emu::clear_state()
+{
+    m_angle_unit = angle_unit_t::radian;
+    memset(m_stack, 0, sizeof(m_stack));
+    memset(m_mem, 0, sizeof(m_mem));
+    memset(m_program, 0, sizeof(m_program));
+    m_prog_counter = 0;
+    memset(m_returns, 0, sizeof(m_returns));
+    m_returns_count = 0;
+    m_running = false;
+    m_programming = false;
+    m_error = false;
+    m_lift = false;
+    m_random = 1;
+    m_prefix = prefix_t::none;
+    m_operand = operand_t::none;
+    m_operand_code = 0;
+    m_address_digit = -1;
+    m_entry = entry_t::none;
+    memset(m_entry_digits, 0, sizeof(m_entry_digits));
+    m_entry_count = 0;
+    m_entry_point = -1;
+    m_entry_negative = false;
+    m_entry_exponent = 0;
+    m_entry_exponent_negative = false;
+}
+
+mk_result_t mk61_opcode_emu::set_power_state(const engine_power_state_t value)
+{
+    if (value == get_power_state())
+        return mk_result_t::mk_ok;
+    mk_engine::set_power_state(value);
+    clear_state();
+    m_is_output_required = true;
+    return mk_result_t::mk_ok;
+}
+
+bool mk61_opcode_emu::is_running()
+{
+    return get_power_state() == engine_power_state_t::engine_on && m_running;
+}
+
+bool mk61_opcode_emu::is_idle()
+{
+    // only the running mode is stepped
+    return !is_running();
+}
+
+mk_result_t mk61_opcode_emu::do_step()
+{
+    if (!is_running())
+        return mk_result_t::mk_ok;
+    for (int i = 0; i < instructions_per_step && m_running; i++)
+        execute_step();
+    m_is_output_required = true;
+    return mk_result_t::mk_ok;
+}
+
+mk_result_t mk61_opcode_emu::do_input(const char* buf, size_t length)
+{
+    if (!mk61_input_key::is_valid(buf, length))
+        return mk_result_t::mk_error;
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return mk_result_t::mk_ok;
+    // keys are processed at once, holding one is a single press
+    const char* end = buf + length;
+    mk61_input_key key;
+    while (mk61_input_key::read(buf, end, key))
+        process_key(key.key1, key.key2);
+    m_is_output_required = true;
+    return mk_result_t::mk_ok;
+}
+
+mk_result_t mk61_opcode_emu::do_key_press(const uint8_t key1, const uint8_t key2)
+{
+    if (get_power_state() == engine_power_state_t::engine_on)
+    {
+        process_key(key1, key2);
+        m_is_output_required = true;
+    }
+    return mk_result_t::mk_ok;
+}
+
+void mk61_opcode_emu::process_key(const uint8_t key1, const uint8_t key2)
+{
+    if (m_operand == operand_t::reg)
+    {
+        m_operand = operand_t::none;
+        int8_t reg = register_key(key1, key2);
+        if (reg >= 0)
+            process_instruction(m_operand_code | reg);
+        return;
+    }
+    if (m_operand == operand_t::address)
+    {
+        int8_t digit = digit_key(key1, key2);
+        if (digit >= 0)
+        {
+            if (m_address_digit < 0)
+            {
+                m_address_digit = digit;
+                return;
+            }
+            const uint8_t code = m_address_digit << 4 | digit;
+            m_operand = operand_t::none;
+            m_address_digit = -1;
+            if (m_programming)
+                store_code(code);
+            else
+                m_prog_counter = (code >> 4) * 10 + (code & 0xf);
+            return;
+        }
+        m_operand = operand_t::none;
+        m_address_digit = -1;
+    }
+    if (key2 == 9 && key1 == 11)
+    {
+        m_prefix = prefix_t::F;
+        return;
+    }
+    if (key2 == 9 && key1 == 10)
+    {
+        m_prefix = prefix_t::K;
+        return;
+    }
+    if (key1 < 2 || key1 > 11)
+        return;
+    const prefix_t prefix = m_prefix;
+    m_prefix = prefix_t::none;
+    const uint8_t index = key1 - 2;
+    int16_t code = key_none;
+    switch (key2)
+    {
+    case 1:
+        if (prefix == prefix_t::F)
+            code = 0x15 + index;
+        else if (prefix == prefix_t::K)
+            code = keys_K_row1[index];
+        else
+            code = index;
+        break;
+    case 8:
+        if (prefix == prefix_t::F)
+            code = keys_F_row8[index];
+        else if (prefix == prefix_t::K)
+            code = keys_K_row8[index];
+        else
+            code = keys_row8[index];
+        break;
+    case 9:
+        if (prefix == prefix_t::F)
+            code = keys_F_row9[index];
+        else if (prefix == prefix_t::K)
+            code = keys_K_row9[index];
+        else
+            code = keys_row9[index];
+        break;
+    }
+    if (code == key_none)
+        return;
+    if ((code & key_reg) != 0)
+    {
+        m_operand = operand_t::reg;
+        m_operand_code = code & 0xff;
+        return;
+    }
+    switch (code)
+    {
+    case key_AUT:
+        m_programming = false;
+        m_lift = false;
+        break;
+    case key_PRG:
+        m_programming = true;
+        m_running = false;
+        break;
+    case key_STEPL:
+        m_prog_counter = (m_prog_counter + MK61_PROGRAM_SIZE - 1) % MK61_PROGRAM_SIZE;
+        break;
+    case key_STEPR:
+        m_prog_counter = next_address(m_prog_counter);
+        break;
+    default:
+        process_instruction(static_cast<uint8_t>(code));
+        break;
+    }
+}
+
+void mk61_opcode_emu::process_instruction(const uint8_t opcode)
+{
+    if (m_programming)
+    {
+        store_code(opcode);
+        if (is_address_instruction(opcode))
+        {
+            m_operand = operand_t::address;
+            m_operand_code = opcode;
+            m_address_digit = -1;
+        }
+        return;
+    }
+    m_error = false;
+    switch (opcode)
+    {
+    case 0x50: // R/S
+        end_entry();
+        m_running = !m_running;
+        break;
+    case 0x51: // GTO, the address is typed next
+        m_operand = operand_t::address;
+        m_operand_code = opcode;
+        m_address_digit = -1;
+        break;
+    case 0x52: // RTN resets the program counter
+        m_prog_counter = 0;
+        m_returns_count = 0;
+        break;
+    case 0x53: // GSB executes a single step
+        execute_step();
+        break;
+    case 0x57: case 0x58: case 0x59: case 0x5A:
+    case 0x5B: case 0x5C: case 0x5D: case 0x5E:
+        break; // Conditions and loops have no effect in the calculation mode
+    default:
+        execute(opcode);
+        break;
+    }
+}
+
+void mk61_opcode_emu::store_code(const uint8_t code)
+{
+    m_program[m_prog_counter] = code;
+    m_prog_counter = next_address(m_prog_counter);
+}
+
+void mk61_opcode_emu::execute_step()
+{
+    const uint8_t opcode = m_program[m_prog_counter];
+    m_prog_counter = next_address(m_prog_counter);
+    execute(opcode);
+}
+
+/**
+ * Executes the instruction as if it was read from the program memory.
+ * The address of the jump instructions is read at the program counter.
+ */
+mk_result_t mk61_opcode_emu::execute(const uint8_t opcode)
+{
+    m_error = false;
+    if (opcode <= 0x0E)
+        enter(opcode);
+    else if (opcode <= 0x3F)
+        execute_function(opcode);
+    else if (opcode <= 0x4E)
+    {
+        end_entry();
+        m_mem[opcode & 0xf] = m_stack[X];
+        m_lift = true;
+    }
+    else if (opcode == 0x50)
+    {
+        end_entry();
+        m_running = false;
+    }
+    else if (opcode == 0x52)
+    {
+        end_entry();
+        if (m_returns_count > 0)
+            m_prog_counter = m_returns[--m_returns_count];
+        else
+            m_prog_counter = 1;
+        m_lift = true;
+    }
+    else if (is_address_instruction(opcode))
+        execute_jump(opcode);
+    else if (opcode >= 0x60 && opcode <= 0x6E)
+        recall(m_mem[opcode & 0xf]);
+    else if (opcode >= 0x70 && opcode <= 0xEE && (opcode & 0xf) != 0xf)
+        execute_indirect(opcode);
+    // Other codes do nothing
+    return m_error ? mk_result_t::mk_error : mk_result_t::mk_ok;
+}
+
+void mk61_opcode_emu::execute_jump(const uint8_t opcode)
+{
+    const uint8_t address = fetch_address();
+    end_entry();
+    m_lift = true;
+    const double x = m_stack[X];
+    bool jump = true;
+    int8_t loop_reg = -1;
+    switch (opcode)
+    {
+    case 0x51: // GTO
+        break;
+    case 0x53: // GSB
+        if (m_returns_count == MK61EMU_RETURNS_COUNT)
+        {
+            memmove(m_returns, m_returns + 1, MK61EMU_RETURNS_COUNT - 1);
+            m_returns_count--;
+        }
+        m_returns[m_returns_count++] = m_prog_counter;
+        break;
+    case 0x57:
+        jump = !(x != 0);
+        break;
+    case 0x59:
+        jump = !(x >= 0);
+        break;
+    case 0x5C:
+        jump = !(x < 0);
+        break;
+    case 0x5E:
+        jump = !(x == 0);
+        break;
+    case 0x5D:
+        loop_reg = 0;
+        break;
+    case 0x5B:
+        loop_reg = 1;
+        break;
+    case 0x58:
+        loop_reg = 2;
+        break;
+    case 0x5A:
+        loop_reg = 3;
+        break;
+    }
+    if (loop_reg >= 0)
+    {
+        // The counter stops at 1
+        const double counter = std::fabs(m_mem[loop_reg]);
+        jump = counter > 1;
+        if (jump)
+            m_mem[loop_reg] = counter - 1;
+    }
+    if (jump)
+        m_prog_counter = address;
+}
+
+void mk61_opcode_emu::execute_indirect(const uint8_t opcode)
+{
+    end_entry();
+    m_lift = true;
+    const uint8_t reg = opcode & 0xf;
+    const uint8_t address = indirect_address(reg);
+    const double x = m_stack[X];
+    bool jump = false;
+    switch (opcode >> 4)
+    {
+    case 0x7:
+        jump = !(x != 0);
+        break;
+    case 0x8:
+        jump = true;
+        break;
+    case 0x9:
+        jump = !(x >= 0);
+        break;
+    case 0xA:
+        if (m_returns_count == MK61EMU_RETURNS_COUNT)
+        {
+            memmove(m_returns, m_returns + 1, MK61EMU_RETURNS_COUNT - 1);
+            m_returns_count--;
+        }
+        m_returns[m_returns_count++] = m_prog_counter;
+        jump = true;
+        break;
+    case 0xB:
+        m_mem[address % MK61EMU_REG_MEM_COUNT] = x;
+        break;
+    case 0xC:
+        jump = !(x < 0);
+        break;
+    case 0xD:
+        recall(m_mem[address % MK61EMU_REG_MEM_COUNT]);
+        break;
+    case 0xE:
+        jump = !(x == 0);
+        break;
+    }
+    if (jump)
+        m_prog_counter = address % MK61_PROGRAM_SIZE;
+}
+
+/**
+ * Logical operations work with the digits after the leading 8 as with 4-bit values
+ */
+static void logic_digits(const double value, io_t digits[7])
+{
+    double fraction = std::fabs(value) - std::trunc(std::fabs(value));
+    long long n = std::llround(fraction * 1e7);
+    for (int i = 6; i >= 0; i--)
+    {
+        digits[i] = n % 10;
+        n /= 10;
+    }
+}
+
+void mk61_opcode_emu::execute_function(const uint8_t opcode)
+{
+    end_entry();
+    const double x = m_stack[X];
+    const double y = m_stack[Y];
+    double result = x;
+    bool binary = false;
+    bool error = false;
+    switch (opcode)
+    {
+    case 0x0F: // LASTx
+        recall(m_stack[X1]);
+        return;
+    case 0x10:
+        result = y + x;
+        binary = true;
+        break;
+    case 0x11:
+        result = y - x;
+        binary = true;
+        break;
+    case 0x12:
+        result = y * x;
+        binary = true;
+        break;
+    case 0x13:
+        error = x == 0;
+        result = error ? 0 : y / x;
+        binary = true;
+        break;
+    case 0x14: // XY
+        m_stack[X1] = x;
+        m_stack[X] = y;
+        m_stack[Y] = x;
+        m_lift = true;
+        return;
+    case 0x15:
+        result = std::pow(10.0, x);
+        break;
+    case 0x16:
+        result = std::exp(x);
+        break;
+    case 0x17:
+        error = x <= 0;
+        result = error ? 0 : std::log10(x);
+        break;
+    case 0x18:
+        error = x <= 0;
+        result = error ? 0 : std::log(x);
+        break;
+    case 0x19:
+        error = std::fabs(x) > 1;
+        result = error ? 0 : from_radians(std::asin(x));
+        break;
+    case 0x1A:
+        error = std::fabs(x) > 1;
+        result = error ? 0 : from_radians(std::acos(x));
+        break;
+    case 0x1B:
+        result = from_radians(std::atan(x));
+        break;
+    case 0x1C:
+        result = std::sin(to_radians(x));
+        break;
+    case 0x1D:
+        result = std::cos(to_radians(x));
+        break;
+    case 0x1E:
+        result = std::tan(to_radians(x));
+        break;
+    case 0x20:
+        recall(PI);
+        m_stack[X1] = x;
+        return;
+    case 0x21:
+        error = x < 0;
+        result = error ? 0 : std::sqrt(x);
+        break;
+    case 0x22:
+        result = x * x;
+        break;
+    case 0x23:
+        error = x == 0;
+        result = error ? 0 : 1 / x;
+        break;
+    case 0x24: // X^Y keeps Y
+        error = x < 0 || (x == 0 && y <= 0);
+        result = error ? 0 : std::pow(x, y);
+        break;
+    case 0x25: // Roll down
+        m_stack[X1] = x;
+        m_stack[X] = y;
+        m_stack[Y] = m_stack[Z];
+        m_stack[Z] = m_stack[T];
+        m_stack[T] = x;
+        m_lift = true;
+        return;
+    case 0x26: // HH.MM to degrees
+    {
+        const double a = std::fabs(x);
+        const double h = std::trunc(a);
+        const double m = std::round((a - h) * 1e8) / 1e6;
+        result = std::copysign(h + m / 60, x);
+        break;
+    }
+    case 0x2A: // HH.MMSS to degrees
+    {
+        const double a = std::fabs(x);
+        const double h = std::trunc(a);
+        const double ms = std::round((a - h) * 1e8) / 1e6;
+        const double m = std::trunc(ms);
+        const double s = (ms - m) * 100;
+        result = std::copysign(h + m / 60 + s / 3600, x);
+        break;
+    }
+    case 0x30: // degrees to HH.MMSS
+    {
+        const double a = std::fabs(x);
+        const double h = std::trunc(a);
+        const double ms = std::round((a - h) * 60 * 1e6) / 1e6;
+        const double m = std::trunc(ms);
+        const double s = (ms - m) * 60;
+        result = std::copysign(h + m / 100 + s / 10000, x);
+        break;
+    }
+    case 0x31:
+        result = std::fabs(x);
+        break;
+    case 0x32:
+        result = x > 0 ? 1 : (x < 0 ? -1 : 0);
+        break;
+    case 0x33: // degrees to HH.MM
+    {
+        const double a = std::fabs(x);
+        const double h = std::trunc(a);
+        result = std::copysign(h + (a - h) * 60 / 100, x);
+        break;
+    }
+    case 0x34:
+        result = std::trunc(x);
+        break;
+    case 0x35:
+        result = x - std::trunc(x);
+        break;
+    case 0x36: // MAX keeps Y
+        result = x > y ? x : y;
+        break;
+    case 0x37:
+    case 0x38:
+    case 0x39:
+    case 0x3A:
+    {
+        io_t dx[7], dy[7];
+        logic_digits(x, dx);
+        logic_digits(y, dy);
+        result = 8;
+        double weight = 0.1;
+        for (int i = 0; i < 7; i++, weight /= 10)
+        {
+            io_t digit;
+            switch (opcode)
+            {
+            case 0x37:
+                digit = dx[i] & dy[i];
+                break;
+            case 0x38:
+                digit = dx[i] | dy[i];
+                break;
+            case 0x39:
+                digit = dx[i] ^ dy[i];
+                break;
+            default:
+                digit = ~dx[i] & 0xf;
+                break;
+            }
+            // Hexadecimal digits are not representable in the decoded register file
+            if (digit > 9)
+                error = true;
+            result += digit * weight;
+        }
+        binary = opcode != 0x3A;
+        break;
+    }
+    case 0x3B:
+        m_random = m_random * 1103515245 + 12345;
+        recall((m_random >> 8) % 10000000 / 1e7);
+        return;
+    default:
+        return; // Empty codes
+    }
+    m_stack[X1] = x;
+    if (binary)
+    {
+        m_stack[Y] = m_stack[Z];
+        m_stack[Z] = m_stack[T];
+    }
+    m_lift = true;
+    if (error)
+        set_error();
+    else
+        set_x(result);
+}
+
+void mk61_opcode_emu::enter(const uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case 0x0D: // Cx
+        end_entry();
+        m_stack[X] = 0;
+        return;
+    case 0x0E: // ENT
+        end_entry();
+        push();
+        m_lift = false;
+        return;
+    case 0x0B: // +/-
+        if (m_entry == entry_t::exponent)
+            m_entry_exponent_negative = !m_entry_exponent_negative;
+        else if (m_entry == entry_t::mantissa)
+            m_entry_negative = !m_entry_negative;
+        else
+        {
+            m_stack[X] = -m_stack[X];
+            m_lift = true;
+            return;
+        }
+        break;
+    case 0x0A: // Decimal point
+        if (m_entry == entry_t::none)
+            enter(0);
+        if (m_entry == entry_t::mantissa && m_entry_point < 0)
+            m_entry_point = m_entry_count;
+        break;
+    case 0x0C: // Exponent
+        if (m_entry == entry_t::none)
+            enter(1);
+        if (m_entry == entry_t::mantissa)
+        {
+            if (m_entry_count == 0)
+                m_entry_digits[m_entry_count++] = 1;
+            m_entry = entry_t::exponent;
+        }
+        break;
+    default: // Digits
+        if (m_entry == entry_t::none)
+        {
+            if (m_lift)
+                push();
+            m_entry = entry_t::mantissa;
+            m_entry_count = 0;
+            m_entry_point = -1;
+            m_entry_negative = false;
+            m_entry_exponent = 0;
+            m_entry_exponent_negative = false;
+        }
+        if (m_entry == entry_t::exponent)
+            m_entry_exponent = (m_entry_exponent * 10 + opcode) % 100;
+        else if (m_entry_count < 8 && (m_entry_count > 0 || opcode != 0 || m_entry_point >= 0))
+            m_entry_digits[m_entry_count++] = opcode;
+        break;
+    }
+    double value = 0;
+    for (int8_t i = 0; i < m_entry_count; i++)
+        value = value * 10 + m_entry_digits[i];
+    int exponent = m_entry_exponent_negative ? -m_entry_exponent : m_entry_exponent;
+    if (m_entry_point >= 0)
+        exponent -= m_entry_count - m_entry_point;
+    value *= std::pow(10.0, exponent);
+    m_stack[X] = m_entry_negative ? -value : value;
+}
+
+void mk61_opcode_emu::end_entry()
+{
+    m_entry = entry_t::none;
+}
+
+void mk61_opcode_emu::push()
+{
+    m_stack[T] = m_stack[Z];
+    m_stack[Z] = m_stack[Y];
+    m_stack[Y] = m_stack[X];
+}
+
+void mk61_opcode_emu::recall(const double value)
+{
+    // lifts even after ENT: that disables the lift for the next digit entry only
+    end_entry();
+    push();
+    m_stack[X] = value;
+    m_lift = true;
+}
+
+void mk61_opcode_emu::set_x(const double value)
+{
+    mk61_number number;
+    if (!std::isfinite(value) || !to_number(value, number))
+    {
+        set_error();
+        return;
+    }
+    double result = 0;
+    for (int i = 0; i < 8; i++)
+        result = result * 10 + number.mantissa[i];
+    result *= std::pow(10.0, number.exponent - 7);
+    m_stack[X] = number.negative ? -result : result;
+}
+
+void mk61_opcode_emu::set_error()
+{
+    m_error = true;
+    m_running = false;
+}
+
+uint8_t mk61_opcode_emu::fetch_address()
+{
+    const uint8_t code = m_program[m_prog_counter];
+    m_prog_counter = next_address(m_prog_counter);
+    return ((code >> 4) * 10 + (code & 0xf)) % MK61_PROGRAM_SIZE;
+}
+
+/**
+ * R0..R3 are decremented and R4..R6 are incremented before use
+ */
+uint8_t mk61_opcode_emu::indirect_address(const uint8_t reg)
+{
+    double value = std::trunc(m_mem[reg]);
+    if (reg <= 3)
+        value -= 1;
+    else if (reg <= 6)
+        value += 1;
+    if (reg <= 6)
+        m_mem[reg] = value;
+    return static_cast<uint8_t>(static_cast<long long>(std::fabs(value)) % 100);
+}
+
+double mk61_opcode_emu::to_radians(const double value) const
+{
+    switch (m_angle_unit)
+    {
+    case angle_unit_t::degree:
+        return value * PI / 180;
+    case angle_unit_t::grade:
+        return value * PI / 200;
+    default:
+        return value;
+    }
+}
+
+double mk61_opcode_emu::from_radians(const double value) const
+{
+    switch (m_angle_unit)
+    {
+    case angle_unit_t::degree:
+        return value * 180 / PI;
+    case angle_unit_t::grade:
+        return value * 200 / PI;
+    default:
+        return value;
+    }
+}
+
+uint8_t mk61_opcode_emu::next_address(const uint8_t address)
+{
+    return (address + 1) % MK61_PROGRAM_SIZE;
+}
+
+void mk61_opcode_emu::format_value(mk61_register_t &reg, const double value) const
+{
+    mk61_number number;
+    to_number(value, number);
+    format_number(reg, number);
+}
+
+const char* mk61_opcode_emu::get_reg_stack_str(mk61emu_reg_stack_t reg)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return "";
+    const uint8_t index = static_cast<uint8_t>(reg);
+    format_value(m_reg_stack_str[index], m_stack[index]);
+    if (m_error && index == X)
+    {
+        clear_register_str(m_reg_stack_str[index]);
+        memcpy(m_reg_stack_str[index], "Err0r", 5); // E, Г, Г, 0, Г on the indicator
+    }
+    return m_reg_stack_str[index];
+}
+
+const char* mk61_opcode_emu::get_reg_mem_str(mk61emu_reg_mem_t reg)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return "";
+    const uint8_t index = static_cast<uint8_t>(reg);
+    format_value(m_reg_mem_str[index], m_mem[index]);
+    return m_reg_mem_str[index];
+}
+
+mk61_number mk61_opcode_emu::get_reg_stack(mk61emu_reg_stack_t reg)
+{
+    mk61_number value;
+    const double x = get_reg_stack_value(reg);
+    if (std::isnan(x))
+    {
+        // E, Г, Г, 0, Г as on the indicator
+        const io_t error[8] = { 14, 13, 13, 0, 13, 15, 15, 15 };
+        memset(&value, 0, sizeof(value));
+        memcpy(value.mantissa, error, sizeof(error));
+    }
+    else
+        to_number(x, value);
+    return value;
+}
+
+mk61_number mk61_opcode_emu::get_reg_mem(mk61emu_reg_mem_t reg)
+{
+    mk61_number value;
+    to_number(get_reg_mem_value(reg), value);
+    return value;
+}
+
+double mk61_opcode_emu::get_reg_stack_value(mk61emu_reg_stack_t reg)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return 0;
+    const uint8_t index = static_cast<uint8_t>(reg);
+    if (m_error && index == X)
+        return std::numeric_limits<double>::quiet_NaN();
+    return m_stack[index];
+}
+
+double mk61_opcode_emu::get_reg_mem_value(mk61emu_reg_mem_t reg)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return 0;
+    return m_mem[static_cast<uint8_t>(reg)];
+}
+
+void mk61_opcode_emu::set_reg_stack(mk61emu_reg_stack_t reg, const mk61_number &value)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        throw std::logic_error("Calculator is off");
+    const uint8_t index = static_cast<uint8_t>(reg);
+    if (index == X)
+    {
+        end_entry();
+        m_error = false;
+        m_lift = true;
+    }
+    m_stack[index] = value.to_double();
+}
+
+void mk61_opcode_emu::set_reg_mem(mk61emu_reg_mem_t reg, const mk61_number &value)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        throw std::logic_error("Calculator is off");
+    m_mem[static_cast<uint8_t>(reg)] = value.to_double();
+}
+
+void mk61_opcode_emu::get_program(mk61_program_t &image)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        memset(image, 0, sizeof(image));
+    else
+        memcpy(image, m_program, sizeof(image));
+}
+
+void mk61_opcode_emu::set_program(const mk61_program_t &image)
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        throw std::logic_error("Calculator is off");
+    memcpy(m_program, image, sizeof(m_program));
+}
+
+angle_unit_t mk61_opcode_emu::get_angle_unit()
+{
+    return m_angle_unit;
+}
+
+void mk61_opcode_emu::set_angle_unit(const angle_unit_t value)
+{
+    m_angle_unit = value;
+}
+
+const char* mk61_opcode_emu::get_indicator_str()
+{
+    memset(m_indicator_str, 0, 15);
+    memset(m_indicator_str, ' ', 12);
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return m_indicator_str;
+    if (m_programming)
+    {
+        // Three last codes and the program counter
+        for (int i = 0; i < 3; i++)
+        {
+            uint8_t address = (m_prog_counter + MK61_PROGRAM_SIZE - 3 + i) % MK61_PROGRAM_SIZE;
+            m_indicator_str[i * 3] = display_symbol(m_program[address] >> 4);
+            m_indicator_str[i * 3 + 1] = display_symbol(m_program[address]);
+        }
+        m_indicator_str[10] = display_symbol(m_prog_counter / 10);
+        m_indicator_str[11] = display_symbol(m_prog_counter % 10);
+        return m_indicator_str;
+    }
+    memcpy(m_indicator_str, get_reg_stack_str(mk61emu_reg_stack_t::RX), mk61_register_positions_count);
+    return m_indicator_str;
+}
+
+const char* mk61_opcode_emu::get_prog_counter_str()
+{
+    if (get_power_state() == engine_power_state_t::engine_off)
+        return "";
+    m_prog_counter_str[0] = display_symbol(m_prog_counter / 10);
+    m_prog_counter_str[1] = display_symbol(m_prog_counter % 10);
+    m_prog_counter_str[2] = 0;
+    return m_prog_counter_str;
+}
+
+const char* mk61_opcode_emu::get_return_str(const uint8_t index)
+{
+    if (get_power_state() == engine_power_state_t::engine_off || index >= MK61EMU_RETURNS_COUNT)
+        return "";
+    // The stack is filled from the start, the next return is the last one pushed.
+    // The chipset keeps the address of the call operand, the one before the return.
+    uint8_t address = 0;
+    if (index < m_returns_count)
+    {
+        address = m_returns[m_returns_count - 1 - index];
+        address = address > 0 ? address - 1 : MK61_PROGRAM_SIZE - 1;
+    }
+    m_return_str[0] = display_symbol(address / 10);
+    m_return_str[1] = display_symbol(address % 10);
+    m_return_str[2] = 0;
+    return m_return_str;
+}
@@ -0,0 +1,115 @@
+#ifndef MK61OPCODE_H_INCLUDED
+#define MK61OPCODE_H_INCLUDED
+
+#include "mk61emu.h"
+
+/**
+ * The MK61 emulator executing the instructions directly on the register file.
+ * Much faster than the chipset emulation but not cycle accurate: numbers are kept
+ * as doubles rounded to 8 significant digits and the undocumented behaviour
+ * of the calculator is not reproduced.
+ */
+class mk61_opcode_emu : public mk61_engine
+{
+public:
+    mk61_opcode_emu();
+    virtual ~mk61_opcode_emu();
+    const char* get_reg_stack_str(mk61emu_reg_stack_t reg) override;
+    angle_unit_t get_angle_unit() override;
+    void set_angle_unit(const angle_unit_t value) override;
+    const char* get_indicator_str() override;
+    const char* get_prog_counter_str() override;
+    const char* get_return_str(const uint8_t index) override;
+    const char* get_reg_mem_str(mk61emu_reg_mem_t reg) override;
+    mk61_number get_reg_stack(mk61emu_reg_stack_t reg) override;
+    mk61_number get_reg_mem(mk61emu_reg_mem_t reg) override;
+    double get_reg_stack_value(mk61emu_reg_stack_t reg) override;
+    double get_reg_mem_value(mk61emu_reg_mem_t reg) override;
+    void set_reg_stack(mk61emu_reg_stack_t reg, const mk61_number &value) override;
+    void set_reg_mem(mk61emu_reg_mem_t reg, const mk61_number &value) override;
+    void get_program(mk61_program_t &image) override;
+    void set_program(const mk61_program_t &image) override;
+    mk_result_t do_step() override;
+    mk_result_t do_input(const char* buf, size_t length) override;
+    mk_result_t do_key_press(const uint8_t key1, const uint8_t key2) override;
+    mk_result_t set_power_state(const engine_power_state_t value) override;
+    bool is_running() override;
+    bool is_idle() override;
+    mk_result_t execute(const uint8_t opcode);
+public:
+    static const int instructions_per_step = 1000; // instructions executed by do_step in the running mode
+private:
+    enum class prefix_t
+    {
+        none,
+        F,
+        K
+    };
+    enum class entry_t
+    {
+        none,
+        mantissa,
+        exponent
+    };
+    enum class operand_t
+    {
+        none,
+        reg,     // register key completes the instruction
+        address  // two digit keys complete the address
+    };
+private:
+    void clear_state();
+    void process_key(const uint8_t key1, const uint8_t key2);
+    void process_instruction(const uint8_t opcode);
+    void store_code(const uint8_t code);
+    void execute_step();
+    void execute_jump(const uint8_t opcode);
+    void execute_indirect(const uint8_t opcode);
+    void execute_function(const uint8_t opcode);
+    void enter(const uint8_t opcode);
+    void end_entry();
+    void push();
+    void recall(const double value);
+    void set_x(const double value);
+    void set_error();
+    void format_value(mk61_register_t &reg, const double value) const;
+    uint8_t fetch_address();
+    uint8_t indirect_address(const uint8_t reg);
+    double to_radians(const double value) const;
+    double from_radians(const double value) const;
+    static uint8_t next_address(const uint8_t address);
+private:
+    angle_unit_t m_angle_unit;
+    double m_stack[MK61EMU_REG_STACK_COUNT]; // X1, X, Y, Z, T
+    double m_mem[MK61EMU_REG_MEM_COUNT];
+    uint8_t m_program[MK61_PROGRAM_SIZE];
+    uint8_t m_prog_counter;
+    uint8_t m_returns[MK61EMU_RETURNS_COUNT];
+    uint8_t m_returns_count;
+    char m_return_str[3];
+    bool m_running;
+    bool m_programming;
+    bool m_error;
+    bool m_lift;
+    uint32_t m_random;
+    // Key input
+    prefix_t m_prefix;
+    operand_t m_operand;
+    uint8_t m_operand_code;
+    int8_t m_address_digit;
+    // Number entry
+    entry_t m_entry;
+    io_t m_entry_digits[8];
+    int8_t m_entry_count;
+    int8_t m_entry_point;
+    bool m_entry_negative;
+    int8_t m_entry_exponent;
+    bool m_entry_exponent_negative;
+    // Output
+    mk61_register_t m_reg_stack_str[MK61EMU_REG_STACK_COUNT];
+    mk61_register_t m_reg_mem_str[MK61EMU_REG_MEM_COUNT];
+    char m_prog_counter_str[3];
+    char m_indicator_str[15];
+};
+
+#endif // MK61OPCODE_H_INCLUDED
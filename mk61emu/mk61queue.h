@@ -0,0 +1,50 @@
+#ifndef MK61QUEUE_H_INCLUDED
+#define MK61QUEUE_H_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Bounded lock-free queue for one producer thread and one consumer thread.
+ * The producer owns the tail, the consumer owns the head; each publishes its
+ * index with release, so the items written before it are seen by the other.
+ */
+template <typename T, size_t capacity> class mk61_spsc_queue
+{
+    static_assert(capacity > 0 && (capacity & (capacity - 1)) == 0, "Capacity must be a power of 2");
+public:
+    mk61_spsc_queue() = default;
+    mk61_spsc_queue(const mk61_spsc_queue&) = delete;
+    mk61_spsc_queue& operator =(const mk61_spsc_queue&) = delete;
+public:
+    // Producer only: false if the queue is full
+    bool push(const T& item)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == capacity)
+            return false;
+        m_items[tail & (capacity - 1)] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    // Consumer only: false if the queue is empty
+    bool pop(T& item)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return false;
+        item = m_items[head & (capacity - 1)];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    bool is_empty() const
+    {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+private:
+    T m_items[capacity];
+    alignas(64) std::atomic<size_t> m_head = 0; // next item to pop
+    alignas(64) std::atomic<size_t> m_tail = 0; // next item to push
+};
+
+#endif // MK61QUEUE_H_INCLUDED
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cctype>
 #include "mk_common.h"
 
 
@@ -15,6 +17,29 @@ std::string strutils::to_upper(const std::string& s)
     // std::transform(cmd_up.begin(), cmd_up.end(), cmd_up.begin(), ::toupper);
 }
 
+bool strutils::equal_nocase(std::string_view lhs, std::string_view rhs)
+{
+    if (lhs.size() != rhs.size())
+        return false;
+    for (size_t i = 0; i < lhs.size(); i++)
+        if (toupper(static_cast<unsigned char>(lhs[i])) != toupper(static_cast<unsigned char>(rhs[i])))
+            return false;
+    return true;
+}
+
+bool strutils::less_nocase::operator ()(std::string_view lhs, std::string_view rhs) const
+{
+    const size_t size = std::min(lhs.size(), rhs.size());
+    for (size_t i = 0; i < size; i++)
+    {
+        const int l = toupper(static_cast<unsigned char>(lhs[i]));
+        const int r = toupper(static_cast<unsigned char>(rhs[i]));
+        if (l != r)
+            return l < r;
+    }
+    return lhs.size() < rhs.size();
+}
+
 /**
  * MK72Engine
  */
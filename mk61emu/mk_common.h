@@ -3,6 +3,7 @@
 
 #include <cinttypes>
 #include <string>
+#include <string_view>
 #include <vector>
 
 typedef unsigned char byte;
@@ -11,6 +12,13 @@ class strutils
 {
 public:
     static std::string to_upper(const std::string& s);
+    static bool equal_nocase(std::string_view lhs, std::string_view rhs);
+    // Case-insensitive order for maps, looked up by any string type
+    struct less_nocase
+    {
+        typedef void is_transparent;
+        bool operator ()(std::string_view lhs, std::string_view rhs) const;
+    };
 };
 
 class mk_instruction